@@ -2,58 +2,1403 @@
 #include "ledmgr.h"
 #include "gattcomm.h"
 #include "sppcomm.h"
+#include "elmcfg.h"
+#include "pwrmgr.h"
+#include "bufpool.h"
+#include "isotp.h"
+#include "elmtiming.h"
+#include "respcount.h"
+#include "elmfmt.h"
+#include "monitor.h"
+#include "probe.h"
+#include "datalog.h"
 
 #include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+#include <freertos/stream_buffer.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define TAG "APP"
 
+// Sent to the client in place of the reply to a command that was lost
+// with the SPP link
+#define LINK_LOST_REPLY        "LINK LOST\r\r>"
+#define STALLED_REPLY          "STALLED\r\r>"
+#define SEARCHING_LINE         "SEARCHING"
+#define REPLAY_STEP_TIMEOUT_MS 2000
+#define SPP_LINE_MAX_LEN       64
+#define CLIENT_LINE_MAX_LEN    64
+#define GATT_TX_BUFFER_LEN     1024
+#define CONTROL_CMD_MAX_LEN    96
+#define BRIDGE_TASK_STACK_SIZE 4096
+#define SPP_EVENT_QUEUE_LEN    16
+#define SPP_RX_CHUNK_LEN       512
+#define COALESCE_REPLY_MAX_LEN 512
+// How long the Bluedroid callback waits for the bridge task
+#define SPP_POST_TIMEOUT_MS    100
+
+// Client commands are held until complete when the bridge may have to
+// send something first or change them
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT || CONFIG_VLINK_ELM_RESPONSE_COUNT || CONFIG_VLINK_ELM_COMPACT_FORMAT
+#define HOLD_CLIENT_LINES 1
+#endif
+
+// The client is held off once the budget is reached, so at most one more
+// write arrives on top of it
+_Static_assert(CONFIG_VLINK_BUFPOOL_BLOCKS * BUFPOOL_BLOCK_SIZE
+                   >= CONFIG_VLINK_PRECONNECT_BUDGET + BUFPOOL_BLOCK_SIZE,
+               "CONFIG_VLINK_BUFPOOL_BLOCKS too small for CONFIG_VLINK_PRECONNECT_BUDGET");
+
+typedef enum
+{
+    APP_STATE_DISCONNECTED,
+    APP_STATE_GATT_CONNECTED,
+    APP_STATE_GATT_SPP_CONNECTED,
+    // GATT client gone, SPP session kept alive for a reconnecting client
+    APP_STATE_SPP_LINGER,
+    // SPP link lost with the GATT client still connected
+    APP_STATE_SPP_RECONNECTING,
+    // Restoring the client's AT settings on the reconnected adapter
+    APP_STATE_SPP_REPLAYING,
+#if CONFIG_VLINK_DATALOG
+    // No client for a while, the adapter is polled for the data log
+    APP_STATE_LOG_CONNECTING,
+    APP_STATE_LOGGING,
+#endif
+} app_state_t;
+
+typedef enum
+{
+    MONITOR_PHASE_OFF,
+    // Monitor settings sent one per prompt, ATMA last
+    MONITOR_PHASE_SETUP,
+    MONITOR_PHASE_RUNNING,
+    // Interrupted, waiting for the prompt
+    MONITOR_PHASE_STOPPING,
+    // ATD sent, the client's settings are replayed after it
+    MONITOR_PHASE_RESTORING,
+} monitor_phase_t;
+
 typedef enum
 {
-    APP_STATE_DISCONNECTED,
-    APP_STATE_GATT_CONNECTED,
-    APP_STATE_GATT_SPP_CONNECTED,
-} app_state_t;
+    SPP_EVENT_CONNECTED,
+    SPP_EVENT_CONNECT_ERROR,
+    SPP_EVENT_DISCONNECTED,
+    // Data waits in the stream buffer
+    SPP_EVENT_RX,
+} spp_event_type_t;
+
+typedef struct
+{
+    spp_event_type_t type;
+    // Bytes put in the stream buffer for an RX event, the bridge takes no
+    // more so that later events keep their order relative to the data
+    uint16_t length;
+    // Bytes of RX events dropped just before this one, they sit in front
+    // of its data once the events ahead of it are handled
+    uint32_t skip;
+} spp_event_t;
+
+struct
+{
+    // Taken by every entry point, the BT callbacks and the state timer
+    // run in different tasks
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lock_buffer;
+    // SPP events are handed from the Bluedroid task to the bridge task,
+    // pinned to the other core
+    TaskHandle_t bridge_task;
+    StaticTask_t bridge_task_buffer;
+    StackType_t bridge_task_stack[BRIDGE_TASK_STACK_SIZE];
+    QueueHandle_t spp_events;
+    StaticQueue_t spp_events_buffer;
+    uint8_t spp_events_storage[SPP_EVENT_QUEUE_LEN * sizeof(spp_event_t)];
+    StreamBufferHandle_t spp_rx;
+    StaticStreamBuffer_t spp_rx_buffer;
+    uint8_t spp_rx_storage[CONFIG_VLINK_BRIDGE_RX_BUFFER + 1];
+    uint8_t spp_rx_chunk[SPP_RX_CHUNK_LEN];
+    // Under spp_drops_mux
+    uint32_t spp_rx_dropped;
+    uint32_t spp_events_dropped;
+    // Buffered data whose RX event was dropped, skipped by the next event
+    // that is queued. Only used in the Bluedroid task.
+    uint32_t spp_rx_orphaned;
+    esp_timer_handle_t state_timer;
+    // Runs while a client command gets no adapter output
+    esp_timer_handle_t stall_timer;
+    // The command in flight may rightly stay silent: a monitor command,
+    // or a protocol search that announced itself
+    bool cmd_unbounded;
+    // Characters of SEARCHING_LINE matched in the adapter output
+    uint8_t searching_pos;
+    app_state_t state;
+    // Client writes held until the SPP link is ready, in arrival order
+    bufpool_buf_t *initial_spp_tx_head;
+    bufpool_buf_t *initial_spp_tx_tail;
+    uint32_t initial_spp_tx_len;
+    // The client's last write was not acknowledged, see gattcomm_resume_rx()
+    bool client_held;
+#if HOLD_CLIENT_LINES
+    // Bytes at the head that already went through line handling
+    uint16_t initial_spp_tx_done_len;
+#endif
+
+    // Client command currently being written, for recording AT settings
+    char client_cmd[ELMCFG_CMD_MAX_LEN];
+    uint16_t client_cmd_len;
+    // A client command was sent and the adapter has not shown its prompt
+    bool cmd_in_flight;
+    // Arrival of the GATT write being handled, 0 outside app_on_gatt_rx
+    int64_t client_rx_time;
+    // A stalled command was interrupted, waiting for the prompt
+    bool cancelling;
+    uint32_t stalls;
+    uint32_t stalls_unrecovered;
+    // The adapter belongs to the CAN monitor, client data is held
+    monitor_phase_t monitor_phase;
+
+    int reconnect_attempts;
+    // -1 while the adapter still has the logger's settings
+    int replay_index;
+#if CONFIG_VLINK_DATALOG
+    // A logger command was sent and the adapter has not shown its prompt
+    bool log_cmd_in_flight;
+#endif
+
+#if HOLD_CLIENT_LINES
+    // Client command held until complete
+    char client_line[CLIENT_LINE_MAX_LEN];
+    uint16_t client_line_len;
+    // A bridge command is running, client data is held meanwhile
+    bool injecting;
+#endif
+
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+    // Request as sent with the count digit, the adapter echo is put back
+    // to what the client wrote
+    char echo[CLIENT_LINE_MAX_LEN];
+    uint16_t echo_len;
+    uint16_t echo_pos;
+#endif
+
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    // OBD request in flight as the client wrote it, and the client output
+    // since, sent again to each repeat of it
+    char coalesce_cmd[ELMCFG_CMD_MAX_LEN];
+    uint16_t coalesce_cmd_len;
+    bool capturing;
+    uint8_t reply[COALESCE_REPLY_MAX_LEN];
+    uint16_t reply_len;
+    bool reply_overflow;
+    // The count digit was added to the request
+    bool cmd_suffixed;
+    // Client bytes matching the request so far, held back from the adapter
+    uint16_t dup_len;
+    // Complete repeats waiting for the reply
+    int dup_count;
+    uint32_t coalesced;
+#endif
+
+#if CONFIG_VLINK_ISOTP_REASSEMBLY
+    // Adapter output line being assembled, passed on once complete
+    char spp_line[SPP_LINE_MAX_LEN];
+    uint16_t spp_line_len;
+    // The last line went to the client, so does its linefeed (ATL1)
+    bool spp_line_passed;
+    // Output to the client collected per SPP chunk
+    char gatt_tx_buffer[GATT_TX_BUFFER_LEN];
+    uint16_t gatt_tx_len;
+#endif
+} ctx;
+
+// The drop counters are written in the Bluedroid task
+static portMUX_TYPE spp_drops_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void lock(void)
+{
+    xSemaphoreTakeRecursive(ctx.lock, portMAX_DELAY);
+}
+
+static void unlock(void)
+{
+    xSemaphoreGiveRecursive(ctx.lock);
+}
+
+static void log_txrx(const char *prefix, const uint8_t *data, uint16_t length)
+{
+    static char buffer[256];
+    if (length > sizeof(buffer) - 1)
+    {
+        length = sizeof(buffer) - 1;
+    }
+    for (int i = 0; i < length; i++)
+    {
+        buffer[i] = (data[i] >= 32 && data[i] <= 126) ? data[i] : '.';
+    }
+    buffer[length] = 0;
+    ESP_LOGI(TAG, "%s %s", prefix, buffer);
+}
+
+static void clear_initial_spp_tx(void)
+{
+    while (ctx.initial_spp_tx_head != NULL)
+    {
+        bufpool_buf_t *buf = ctx.initial_spp_tx_head;
+        ctx.initial_spp_tx_head = buf->next;
+        bufpool_free(buf);
+    }
+    ctx.initial_spp_tx_tail = NULL;
+    ctx.initial_spp_tx_len = 0;
+#if HOLD_CLIENT_LINES
+    ctx.initial_spp_tx_done_len = 0;
+#endif
+
+    if (ctx.client_held)
+    {
+        ctx.client_held = false;
+        gattcomm_resume_rx();
+    }
+}
+
+static void restart_stall_timer(void)
+{
+    if (CONFIG_VLINK_CMD_STALL_TIMEOUT_MS > 0 && !ctx.cmd_unbounded)
+    {
+        esp_timer_stop(ctx.stall_timer);
+        esp_timer_start_once(ctx.stall_timer, CONFIG_VLINK_CMD_STALL_TIMEOUT_MS * 1000);
+    }
+}
+
+static void set_cmd_in_flight(bool in_flight, bool completed)
+{
+    if (in_flight == ctx.cmd_in_flight)
+    {
+        return;
+    }
+
+    ctx.cmd_in_flight = in_flight;
+    if (in_flight)
+    {
+        ctx.searching_pos = 0;
+        pwrmgr_on_cmd_start(ctx.client_rx_time);
+        restart_stall_timer();
+    }
+    else
+    {
+        pwrmgr_on_cmd_end(completed);
+        esp_timer_stop(ctx.stall_timer);
+    }
+}
+
+// Per-adapter state learned while a client uses the adapter
+static void start_session_trackers(void)
+{
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+    elmtiming_start(sppcomm_get_peer_addr());
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+    respcount_start(sppcomm_get_peer_addr());
+#endif
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+    elmfmt_start();
+#endif
+}
+
+static void stop_session_trackers(void)
+{
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+    elmtiming_stop();
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+    respcount_stop();
+#endif
+}
+
+static void set_state(app_state_t new_state)
+{
+#if CONFIG_VLINK_DATALOG
+    if (ctx.state == APP_STATE_LOGGING && new_state != APP_STATE_LOGGING)
+    {
+        datalog_end_session();
+    }
+    ctx.log_cmd_in_flight = false;
+#endif
+    ctx.state = new_state;
+#if HOLD_CLIENT_LINES
+    ctx.injecting = false;
+    ctx.client_line_len = 0;
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+    ctx.echo_len = 0;
+#endif
+    if (ctx.cancelling)
+    {
+        ctx.cancelling = false;
+        esp_timer_stop(ctx.stall_timer);
+    }
+    ctx.monitor_phase = MONITOR_PHASE_OFF;
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    ctx.capturing = false;
+    ctx.dup_len = 0;
+    ctx.dup_count = 0;
+#endif
+    // A GATT probe outlives the adapter link, not the client
+    if (probe_get_mode() == PROBE_MODE_SPP
+        || new_state == APP_STATE_DISCONNECTED
+        || new_state == APP_STATE_SPP_LINGER)
+    {
+        probe_end();
+    }
+    esp_timer_stop(ctx.state_timer);
+    switch (ctx.state)
+    {
+    case APP_STATE_DISCONNECTED:
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+    case APP_STATE_LOGGING:
+#endif
+        set_cmd_in_flight(false, false);
+        clear_initial_spp_tx();
+        stop_session_trackers();
+#if CONFIG_VLINK_ISOTP_REASSEMBLY
+        ctx.spp_line_len = 0;
+        isotp_reset();
+#endif
+        ledmgr_on_disconnected();
+#if CONFIG_VLINK_DATALOG
+        if (ctx.state == APP_STATE_DISCONNECTED)
+        {
+            // The logger takes the adapter unless a client turns up first
+            esp_timer_start_once(ctx.state_timer, CONFIG_VLINK_DATALOG_START_DELAY_S * 1000000ULL);
+        }
+#endif
+        break;
+    case APP_STATE_GATT_CONNECTED:
+    case APP_STATE_SPP_RECONNECTING:
+    case APP_STATE_SPP_REPLAYING:
+        ledmgr_on_connecting();
+        break;
+    case APP_STATE_GATT_SPP_CONNECTED:
+        ledmgr_on_connected();
+        break;
+    case APP_STATE_SPP_LINGER:
+        ledmgr_on_connecting();
+        esp_timer_start_once(ctx.state_timer, CONFIG_VLINK_LINGER_SECS * 1000000ULL);
+        break;
+    }
+}
+
+#if CONFIG_VLINK_COALESCE_REQUESTS
+static void start_capture(const char *cmd, uint16_t length)
+{
+    if (ctx.cmd_suffixed)
+    {
+        // Repeats come without the count digit
+        ctx.cmd_suffixed = false;
+        length--;
+    }
+    bool obd_request = length >= 2 && length <= sizeof(ctx.coalesce_cmd);
+    for (uint16_t i = 0; obd_request && i < length; i++)
+    {
+        obd_request = isxdigit((unsigned char)cmd[i]) || cmd[i] == ' ';
+    }
+    ctx.coalesce_cmd_len = obd_request ? length : 0;
+    memcpy(ctx.coalesce_cmd, cmd, ctx.coalesce_cmd_len);
+    ctx.capturing = obd_request;
+    ctx.reply_len = 0;
+    ctx.reply_overflow = false;
+}
+#endif
+
+// ATMA, ATMR and ATMT print nothing on a quiet or filtered bus
+static bool is_monitor_cmd(const char *cmd, uint16_t length)
+{
+    char norm[ELMCFG_CMD_MAX_LEN];
+    int norm_len = elmcfg_normalize(cmd, length, norm, sizeof(norm));
+    return norm_len >= 4
+           && strncmp(norm, "ATM", 3) == 0
+           && (norm[3] == 'A' || norm[3] == 'R' || norm[3] == 'T');
+}
+
+// A search goes quiet through the slow initialisations after SEARCHING...
+static void check_searching(const uint8_t *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length && !ctx.cmd_unbounded; i++)
+    {
+        if (data[i] == SEARCHING_LINE[ctx.searching_pos])
+        {
+            if (++ctx.searching_pos == strlen(SEARCHING_LINE))
+            {
+                ctx.cmd_unbounded = true;
+                esp_timer_stop(ctx.stall_timer);
+            }
+        }
+        else
+        {
+            ctx.searching_pos = data[i] == SEARCHING_LINE[0] ? 1 : 0;
+        }
+    }
+}
+
+static void track_client_tx(const uint8_t *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        if (data[i] != '\r')
+        {
+            if (ctx.client_cmd_len < sizeof(ctx.client_cmd))
+            {
+                ctx.client_cmd[ctx.client_cmd_len] = data[i];
+            }
+            ctx.client_cmd_len++;
+            continue;
+        }
+
+        if (ctx.client_cmd_len <= sizeof(ctx.client_cmd))
+        {
+            elmcfg_record(ctx.client_cmd, ctx.client_cmd_len);
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+            elmtiming_on_request(ctx.client_cmd, ctx.client_cmd_len);
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+            respcount_on_request(ctx.client_cmd, ctx.client_cmd_len);
+#endif
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+            elmfmt_on_request(ctx.client_cmd, ctx.client_cmd_len);
+#endif
+        }
+#if CONFIG_VLINK_COALESCE_REQUESTS
+        start_capture(ctx.client_cmd, ctx.client_cmd_len);
+#endif
+        ctx.cmd_unbounded = ctx.client_cmd_len <= sizeof(ctx.client_cmd)
+                            && is_monitor_cmd(ctx.client_cmd, ctx.client_cmd_len);
+        ctx.client_cmd_len = 0;
+        set_cmd_in_flight(true, false);
+#if CONFIG_VLINK_ISOTP_REASSEMBLY
+        isotp_reset();
+#endif
+    }
+}
+
+static void send_client_bytes(const uint8_t *data, uint16_t length)
+{
+    log_txrx("GATT   ME-->SPP", data, length);
+    track_client_tx(data, length);
+    sppcomm_tx(data, length);
+}
+
+#if CONFIG_VLINK_COALESCE_REQUESTS
+// Client bytes repeating the OBD request in flight are held back, a
+// complete repeat waits for its reply. Returns the bytes taken.
+static uint16_t take_duplicate(const uint8_t *data, uint16_t length)
+{
+    uint16_t i = 0;
+    for (; i < length && ctx.cmd_in_flight && ctx.capturing; i++)
+    {
+        if (ctx.dup_len == ctx.coalesce_cmd_len && data[i] == '\r')
+        {
+            ctx.dup_count++;
+            ctx.coalesced++;
+            ctx.dup_len = 0;
+            ESP_LOGI(TAG, "Coalesced %.*s, %d waiting", ctx.coalesce_cmd_len, ctx.coalesce_cmd, ctx.dup_count);
+        }
+        else if (ctx.dup_len < ctx.coalesce_cmd_len && data[i] == ctx.coalesce_cmd[ctx.dup_len])
+        {
+            ctx.dup_len++;
+        }
+        else
+        {
+            // Anything else interrupts the request as before
+            send_client_bytes((const uint8_t *)ctx.coalesce_cmd, ctx.dup_len);
+            ctx.dup_len = 0;
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+static void spp_tx_from_client(const uint8_t *data, uint16_t length)
+{
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    uint16_t taken = take_duplicate(data, length);
+    data += taken;
+    length -= taken;
+    if (length == 0)
+    {
+        return;
+    }
+#endif
+    send_client_bytes(data, length);
+}
+
+static bool buffer_initial_spp_tx(const uint8_t *data, uint16_t length)
+{
+    while (length > 0)
+    {
+        bufpool_buf_t *buf = ctx.initial_spp_tx_tail;
+        if (buf == NULL || buf->length == BUFPOOL_BLOCK_SIZE)
+        {
+            buf = bufpool_alloc();
+            if (buf == NULL)
+            {
+                ESP_LOGW(TAG, "Out of packet buffers");
+                return false;
+            }
+            if (ctx.initial_spp_tx_tail != NULL)
+            {
+                ctx.initial_spp_tx_tail->next = buf;
+            }
+            else
+            {
+                ctx.initial_spp_tx_head = buf;
+            }
+            ctx.initial_spp_tx_tail = buf;
+        }
+
+        uint16_t chunk = BUFPOOL_BLOCK_SIZE - buf->length;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(buf->data + buf->length, data, chunk);
+        buf->length += chunk;
+        ctx.initial_spp_tx_len += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+#if !HOLD_CLIENT_LINES
+static void flush_initial_spp_tx(void)
+{
+    // Forwarded straight from the held blocks
+    for (bufpool_buf_t *buf = ctx.initial_spp_tx_head; buf != NULL; buf = buf->next)
+    {
+        spp_tx_from_client(buf->data, buf->length);
+    }
+    clear_initial_spp_tx();
+}
+#endif
+
+static void send_to_client(const uint8_t *data, uint16_t length)
+{
+    log_txrx("GATT<--ME   SPP", data, length);
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    if (ctx.capturing && !ctx.reply_overflow)
+    {
+        if (ctx.reply_len + length > sizeof(ctx.reply))
+        {
+            ctx.reply_overflow = true;
+        }
+        else
+        {
+            memcpy(ctx.reply + ctx.reply_len, data, length);
+            ctx.reply_len += length;
+        }
+    }
+#endif
+    gattcomm_tx(data, length);
+}
+
+static void forward_to_client(const uint8_t *data, uint16_t length)
+{
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+    elmfmt_format(data, length, send_to_client);
+#else
+    send_to_client(data, length);
+#endif
+}
+
+#if CONFIG_VLINK_ISOTP_REASSEMBLY
+static void flush_gatt_tx(void)
+{
+    if (ctx.gatt_tx_len > 0)
+    {
+        forward_to_client((const uint8_t *)ctx.gatt_tx_buffer, ctx.gatt_tx_len);
+        ctx.gatt_tx_len = 0;
+    }
+}
+
+static void append_gatt_tx(const char *data, uint16_t length)
+{
+    while (length > 0)
+    {
+        if (ctx.gatt_tx_len == sizeof(ctx.gatt_tx_buffer))
+        {
+            flush_gatt_tx();
+        }
+        uint16_t chunk = sizeof(ctx.gatt_tx_buffer) - ctx.gatt_tx_len;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(ctx.gatt_tx_buffer + ctx.gatt_tx_len, data, chunk);
+        ctx.gatt_tx_len += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+// Lines are held until complete so that CAN frames can be taken out for
+// reassembly, the reassembled messages go out in front of the prompt
+static void forward_spp_rx(const uint8_t *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        if (c == '\r')
+        {
+            ctx.spp_line_passed = !isotp_on_line(ctx.spp_line, ctx.spp_line_len);
+            if (ctx.spp_line_passed)
+            {
+                append_gatt_tx(ctx.spp_line, ctx.spp_line_len);
+                append_gatt_tx("\r", 1);
+            }
+            ctx.spp_line_len = 0;
+        }
+        else if (c == '\n' && ctx.spp_line_len == 0)
+        {
+            // Kept out of the line so that frames parse and the prompt
+            // that follows is recognised
+            if (ctx.spp_line_passed)
+            {
+                append_gatt_tx("\n", 1);
+            }
+        }
+        else if (c == '>' && ctx.spp_line_len == 0)
+        {
+            isotp_flush(append_gatt_tx);
+            append_gatt_tx(">", 1);
+        }
+        else
+        {
+            if (ctx.spp_line_len == sizeof(ctx.spp_line))
+            {
+                // Not a CAN frame, pass it on as is
+                append_gatt_tx(ctx.spp_line, ctx.spp_line_len);
+                ctx.spp_line_len = 0;
+            }
+            ctx.spp_line[ctx.spp_line_len++] = c;
+        }
+    }
+    flush_gatt_tx();
+}
+#endif
+
+static void forward_adapter_output(const uint8_t *data, uint16_t length)
+{
+#if CONFIG_VLINK_ISOTP_REASSEMBLY
+    forward_spp_rx(data, length);
+#else
+    forward_to_client(data, length);
+#endif
+}
+
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+// Drops the count digit from the adapter's echo, which may be split over
+// several chunks
+static void forward_restoring_echo(const uint8_t *data, uint16_t length)
+{
+    uint16_t i = 0;
+    while (ctx.echo_len > 0 && i < length)
+    {
+        if (data[i] != ctx.echo[ctx.echo_pos])
+        {
+            // Echo is off
+            ctx.echo_len = 0;
+            break;
+        }
+        i++;
+        if (++ctx.echo_pos == ctx.echo_len)
+        {
+            if (i > 1)
+            {
+                forward_adapter_output(data, i - 1);
+            }
+            data += i;
+            length -= i;
+            ctx.echo_len = 0;
+        }
+    }
+    if (length > 0)
+    {
+        forward_adapter_output(data, length);
+    }
+}
+#endif
+
+static void disconnect_all(void)
+{
+    set_state(APP_STATE_DISCONNECTED);
+    sppcomm_disconnect();
+    gattcomm_disconnect();
+}
+
+// Returns false when the client has to be held off
+static bool hold_client_data(const uint8_t *data, uint16_t length)
+{
+    if (!buffer_initial_spp_tx(data, length))
+    {
+        // Only reachable with writes that cannot be held off
+        disconnect_all();
+        return true;
+    }
+    if (ctx.initial_spp_tx_len >= CONFIG_VLINK_PRECONNECT_BUDGET)
+    {
+        ctx.client_held = true;
+        return false;
+    }
+    return true;
+}
+
+#if HOLD_CLIENT_LINES
+static void send_bridge_command(const char *cmd)
+{
+    ESP_LOGI(TAG, "Sending %.*s before client command", (int)strlen(cmd) - 1, cmd);
+    sppcomm_tx((const uint8_t *)cmd, strlen(cmd));
+    ctx.injecting = true;
+    esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+}
+
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+static void append_response_count(void)
+{
+    if (ctx.client_line_len == sizeof(ctx.client_line))
+    {
+        return;
+    }
+    char digit = respcount_suffix(ctx.client_line, ctx.client_line_len - 1);
+    if (digit == 0)
+    {
+        return;
+    }
+
+    // "010C\r" goes out as "010C1\r"
+    ctx.client_line[ctx.client_line_len - 1] = digit;
+    ctx.client_line[ctx.client_line_len++] = '\r';
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    ctx.cmd_suffixed = true;
+#endif
+    memcpy(ctx.echo, ctx.client_line, ctx.client_line_len - 1);
+    ctx.echo_len = ctx.client_line_len - 1;
+    ctx.echo_pos = 0;
+}
+#endif
+
+static void send_client_line(void)
+{
+    const char *inject = NULL;
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+    elmfmt_on_client_line(ctx.client_line, ctx.client_line_len - 1, send_to_client);
+    inject = elmfmt_before_request();
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+    append_response_count();
+#endif
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+    if (inject == NULL)
+    {
+        inject = elmtiming_before_request(ctx.client_line, ctx.client_line_len - 1);
+    }
+#endif
+    if (inject == NULL)
+    {
+        spp_tx_from_client((const uint8_t *)ctx.client_line, ctx.client_line_len);
+        return;
+    }
+
+    send_bridge_command(inject);
+    buffer_initial_spp_tx((const uint8_t *)ctx.client_line, ctx.client_line_len);
+    ctx.initial_spp_tx_done_len = ctx.client_line_len;
+}
+
+static bool forward_client_data(const uint8_t *data, uint16_t length)
+{
+    while (length > 0)
+    {
+        if (ctx.injecting)
+        {
+            return hold_client_data(data, length);
+        }
+
+        const uint8_t *cr = memchr(data, '\r', length);
+        uint16_t chunk = cr != NULL ? cr - data + 1 : length;
+
+        if (ctx.cmd_in_flight)
+        {
+            // Interrupts the running command, must not wait for a '\r'
+            spp_tx_from_client(data, chunk);
+        }
+        else
+        {
+            for (uint16_t i = 0; i < chunk; i++)
+            {
+                if (ctx.client_line_len == sizeof(ctx.client_line))
+                {
+                    spp_tx_from_client((const uint8_t *)ctx.client_line, ctx.client_line_len);
+                    ctx.client_line_len = 0;
+                }
+                ctx.client_line[ctx.client_line_len++] = data[i];
+            }
+            if (cr != NULL)
+            {
+                send_client_line();
+                ctx.client_line_len = 0;
+            }
+        }
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Held writes go through line handling like new ones, and are held again
+// behind another bridge command
+static void forward_held_client_data(void)
+{
+    bufpool_buf_t *buf = ctx.initial_spp_tx_head;
+    uint16_t done_len = ctx.initial_spp_tx_done_len;
+    bool client_held = ctx.client_held;
+    ctx.initial_spp_tx_head = NULL;
+    ctx.initial_spp_tx_tail = NULL;
+    ctx.initial_spp_tx_len = 0;
+    ctx.initial_spp_tx_done_len = 0;
+    ctx.client_held = false;
+
+    while (buf != NULL)
+    {
+        bufpool_buf_t *next = buf->next;
+        if (ctx.state == APP_STATE_GATT_SPP_CONNECTED)
+        {
+            uint16_t done = done_len < buf->length ? done_len : buf->length;
+            if (done > 0)
+            {
+                spp_tx_from_client(buf->data, done);
+                done_len -= done;
+            }
+            forward_client_data(buf->data + done, buf->length - done);
+        }
+        bufpool_free(buf);
+        buf = next;
+    }
+
+    if (client_held)
+    {
+        if (ctx.initial_spp_tx_len < CONFIG_VLINK_PRECONNECT_BUDGET)
+        {
+            gattcomm_resume_rx();
+        }
+        else
+        {
+            ctx.client_held = true;
+        }
+    }
+}
+
+static void finish_injection(void)
+{
+    esp_timer_stop(ctx.state_timer);
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+    // The output format takes one command per setting
+    const char *inject = elmfmt_before_request();
+    if (inject != NULL)
+    {
+        send_bridge_command(inject);
+        return;
+    }
+#endif
+    ctx.injecting = false;
+    forward_held_client_data();
+}
+#endif
+
+static void release_held_client_data(void)
+{
+#if HOLD_CLIENT_LINES
+    forward_held_client_data();
+#else
+    flush_initial_spp_tx();
+#endif
+}
+
+#if CONFIG_VLINK_COALESCE_REQUESTS
+// The start of a repeat goes in front of the client's next data
+static void hold_duplicate_prefix(void)
+{
+    if (ctx.dup_len > 0)
+    {
+        buffer_initial_spp_tx((const uint8_t *)ctx.coalesce_cmd, ctx.dup_len);
+        ctx.dup_len = 0;
+    }
+}
+
+// Repeats of a request that got no reply share its fate
+static void fail_duplicates(const char *reply)
+{
+    for (; ctx.dup_count > 0; ctx.dup_count--)
+    {
+        gattcomm_tx((const uint8_t *)reply, strlen(reply));
+    }
+    ctx.capturing = false;
+    hold_duplicate_prefix();
+}
+
+// Called at the prompt ending a request
+static void finish_coalescing(void)
+{
+    ctx.capturing = false;
+    if (ctx.dup_count > 0 && ctx.reply_overflow)
+    {
+        // Too long to keep: one repeat goes to the adapter as a request of
+        // its own and the others stay attached to it. They are paced one
+        // per prompt this way, never sent back to back.
+        ctx.dup_count--;
+        send_client_bytes((const uint8_t *)ctx.coalesce_cmd, ctx.coalesce_cmd_len);
+        send_client_bytes((const uint8_t *)"\r", 1);
+        return;
+    }
+    // Each repeat gets its own copy, notified in one burst as the client
+    // would have got them from the adapter one after another
+    for (; ctx.dup_count > 0; ctx.dup_count--)
+    {
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+        elmfmt_echo(ctx.coalesce_cmd, ctx.coalesce_cmd_len, send_to_client);
+#endif
+        send_to_client(ctx.reply, ctx.reply_len);
+    }
+    if (ctx.dup_len > 0)
+    {
+        hold_duplicate_prefix();
+        release_held_client_data();
+    }
+}
+#endif
+
+static void finish_cancel(void)
+{
+    esp_timer_stop(ctx.stall_timer);
+    ctx.cancelling = false;
+    log_txrx("GATT<--ME   SPP", (const uint8_t *)STALLED_REPLY, strlen(STALLED_REPLY));
+    gattcomm_tx((const uint8_t *)STALLED_REPLY, strlen(STALLED_REPLY));
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    fail_duplicates(STALLED_REPLY);
+#endif
+    release_held_client_data();
+}
+
+static void start_reconnect(void)
+{
+    // Fail the command whose reply went down with the link, commands
+    // written from now on are held until the session is restored
+    if (ctx.cmd_in_flight)
+    {
+        gattcomm_tx((const uint8_t *)LINK_LOST_REPLY, strlen(LINK_LOST_REPLY));
+#if CONFIG_VLINK_COALESCE_REQUESTS
+        fail_duplicates(LINK_LOST_REPLY);
+#endif
+        set_cmd_in_flight(false, false);
+    }
+
+    ESP_LOGI(TAG, "SPP link lost, reconnecting");
+    ctx.reconnect_attempts = 1;
+    set_state(APP_STATE_SPP_RECONNECTING);
+    sppcomm_reconnect();
+}
+
+static void retry_reconnect(void)
+{
+    if (ctx.reconnect_attempts < CONFIG_VLINK_SPP_RECONNECT_ATTEMPTS)
+    {
+        ctx.reconnect_attempts++;
+        ESP_LOGI(TAG, "SPP reconnect attempt %d", ctx.reconnect_attempts);
+        set_state(APP_STATE_SPP_RECONNECTING);
+        sppcomm_reconnect();
+        return;
+    }
+
+    ESP_LOGW(TAG, "SPP reconnect failed");
+    for (bufpool_buf_t *buf = ctx.initial_spp_tx_head; buf != NULL; buf = buf->next)
+    {
+        for (uint16_t i = 0; i < buf->length; i++)
+        {
+            if (buf->data[i] == '\r')
+            {
+                gattcomm_tx((const uint8_t *)LINK_LOST_REPLY, strlen(LINK_LOST_REPLY));
+            }
+        }
+    }
+    clear_initial_spp_tx();
+    set_state(APP_STATE_DISCONNECTED);
+    gattcomm_disconnect();
+}
+
+static void replay_next(void)
+{
+#if CONFIG_VLINK_DATALOG
+    if (ctx.replay_index < 0)
+    {
+        // Back to defaults before the client's settings
+        ctx.replay_index = 0;
+        ESP_LOGI(TAG, "Resetting adapter after logging");
+        sppcomm_tx((const uint8_t *)"ATD\r", 4);
+        esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+        return;
+    }
+#endif
+    if (ctx.replay_index < elmcfg_count())
+    {
+        const char *cmd = elmcfg_get(ctx.replay_index++);
+        ESP_LOGI(TAG, "Replaying %s", cmd);
+        sppcomm_tx((const uint8_t *)cmd, strlen(cmd));
+        sppcomm_tx((const uint8_t *)"\r", 1);
+        esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+        return;
+    }
+
+    ESP_LOGI(TAG, "SPP session restored");
+    set_state(APP_STATE_GATT_SPP_CONNECTED);
+    release_held_client_data();
+}
+
+static void send_monitor_cmd(const char *cmd, bool wait_prompt)
+{
+    ESP_LOGI(TAG, "Monitor: %.*s", (int)strlen(cmd) - 1, cmd);
+    sppcomm_tx((const uint8_t *)cmd, strlen(cmd));
+    if (wait_prompt)
+    {
+        esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+    }
+}
+
+static void start_monitor_step(void)
+{
+    bool last;
+    const char *cmd = monitor_next_setup_cmd(&last);
+    if (last)
+    {
+        ctx.monitor_phase = MONITOR_PHASE_RUNNING;
+    }
+    send_monitor_cmd(cmd, !last);
+}
+
+static void stop_monitor(void)
+{
+    switch (ctx.monitor_phase)
+    {
+    case MONITOR_PHASE_RUNNING:
+        // Any character stops ATMA
+        monitor_flush();
+        esp_timer_stop(ctx.state_timer);
+        sppcomm_tx((const uint8_t *)" ", 1);
+        esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+        ctx.monitor_phase = MONITOR_PHASE_STOPPING;
+        break;
+    case MONITOR_PHASE_SETUP:
+        // Carries on from the prompt of the command being run
+        ctx.monitor_phase = MONITOR_PHASE_STOPPING;
+        break;
+    case MONITOR_PHASE_OFF:
+    case MONITOR_PHASE_STOPPING:
+    case MONITOR_PHASE_RESTORING:
+        break;
+    }
+}
+
+// Moves on after a prompt, or after the adapter failed to show one
+static void advance_monitor(void)
+{
+    esp_timer_stop(ctx.state_timer);
+    switch (ctx.monitor_phase)
+    {
+    case MONITOR_PHASE_SETUP:
+        start_monitor_step();
+        break;
+    case MONITOR_PHASE_RUNNING:
+        // Stopped by BUFFER FULL, monitoring resumes
+        monitor_flush();
+        start_monitor_step();
+        break;
+    case MONITOR_PHASE_STOPPING:
+        ctx.monitor_phase = MONITOR_PHASE_RESTORING;
+        send_monitor_cmd("ATD\r", true);
+        break;
+    case MONITOR_PHASE_RESTORING:
+        ESP_LOGI(TAG, "Monitor stopped, replaying %d settings", elmcfg_count());
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+        elmtiming_on_adapter_reset();
+#endif
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+        elmfmt_on_adapter_reset();
+#endif
+        ctx.replay_index = 0;
+        set_state(APP_STATE_SPP_REPLAYING);
+        replay_next();
+        break;
+    case MONITOR_PHASE_OFF:
+        break;
+    }
+}
+
+static void on_monitor_rx(const uint8_t *data, uint16_t length, bool has_prompt)
+{
+    if (ctx.monitor_phase == MONITOR_PHASE_RUNNING
+        && monitor_on_rx(data, length)
+        && !esp_timer_is_active(ctx.state_timer))
+    {
+        // Records wait for a full notification, but not for long
+        esp_timer_start_once(ctx.state_timer, CONFIG_VLINK_MONITOR_FLUSH_MS * 1000);
+    }
+    if (has_prompt)
+    {
+        advance_monitor();
+    }
+}
+
+// No client command, bridge command, monitor or probe is running
+static bool is_adapter_idle(void)
+{
+    return ctx.monitor_phase == MONITOR_PHASE_OFF
+        && probe_get_mode() == PROBE_MODE_OFF
+        && !ctx.cmd_in_flight
+        && !ctx.cancelling
+#if HOLD_CLIENT_LINES
+        && !ctx.injecting
+#endif
+        ;
+}
+
+static bool start_monitor(const char *ids, uint16_t length)
+{
+    if (ctx.state != APP_STATE_GATT_SPP_CONNECTED || !is_adapter_idle())
+    {
+        ESP_LOGW(TAG, "Adapter busy, monitor not started");
+        return false;
+    }
+    if (!monitor_configure(ids, length))
+    {
+        return false;
+    }
+    ctx.monitor_phase = MONITOR_PHASE_SETUP;
+    start_monitor_step();
+    return true;
+}
+
+static void send_probe_cmd(void)
+{
+    esp_timer_stop(ctx.state_timer);
+    const char *cmd = probe_next_cmd();
+    if (cmd == NULL)
+    {
+        ESP_LOGI(TAG, "Probe done");
+        release_held_client_data();
+        return;
+    }
+    sppcomm_tx((const uint8_t *)cmd, strlen(cmd));
+    esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+}
+
+#if CONFIG_VLINK_BLE_COMPRESSION
+static bool set_compression(bool enabled)
+{
+    // Only between replies, the client knows where the window starts
+    if (!is_adapter_idle())
+    {
+        ESP_LOGW(TAG, "Adapter busy, compression not changed");
+        return false;
+    }
+    gattcomm_set_compression(enabled);
+    return true;
+}
+#endif
+
+static bool start_probe(const char *args, uint16_t length)
+{
+    bool gatt_connected = ctx.state == APP_STATE_GATT_CONNECTED || ctx.state == APP_STATE_GATT_SPP_CONNECTED;
+    if (!gatt_connected || !is_adapter_idle())
+    {
+        ESP_LOGW(TAG, "Bridge busy, probe not started");
+        return false;
+    }
+
+    if (strcmp(args, " ECHO") == 0)
+    {
+        return probe_start_gatt(PROBE_MODE_ECHO);
+    }
+    if (strcmp(args, " SINK") == 0)
+    {
+        return probe_start_gatt(PROBE_MODE_SINK);
+    }
+    if (strcmp(args, " FLOOD") == 0)
+    {
+        return probe_start_gatt(PROBE_MODE_FLOOD);
+    }
+    if (strncmp(args, " SPP", 4) == 0 && ctx.state == APP_STATE_GATT_SPP_CONNECTED)
+    {
+        // "PROBE SPP 010C,010D", 0100 without a script
+        if (!probe_start_spp(args + 4, length - 4))
+        {
+            return false;
+        }
+        send_probe_cmd();
+        return true;
+    }
+    return false;
+}
+
+#if CONFIG_VLINK_DATALOG
+static void send_log_cmd(void)
+{
+    esp_timer_stop(ctx.state_timer);
+    const char *cmd = datalog_next_cmd();
+    ctx.log_cmd_in_flight = cmd != NULL;
+    if (cmd == NULL)
+    {
+        // Poll cycle done, the next one starts after the interval
+        esp_timer_start_once(ctx.state_timer, CONFIG_VLINK_DATALOG_INTERVAL_MS * 1000ULL);
+        return;
+    }
+    sppcomm_tx((const uint8_t *)cmd, strlen(cmd));
+    esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+}
+
+static void start_logging(void)
+{
+    set_state(APP_STATE_LOGGING);
+    datalog_start_session(sppcomm_get_peer_addr());
+    send_log_cmd();
+}
 
-struct
+// The client gets the logger's SPP session, the adapter is reset once
+// the running command is done
+static void hand_over_logging(void)
 {
-    app_state_t state;
-    uint8_t initial_spp_tx_buffer[512];
-    uint16_t initial_spp_tx_buffer_len;
-} ctx;
+    bool log_cmd_in_flight = ctx.log_cmd_in_flight;
+    ESP_LOGI(TAG, "Client connected, taking over the logging session");
+    elmcfg_reset();
+    start_session_trackers();
+    ctx.replay_index = -1;
+    set_state(APP_STATE_SPP_REPLAYING);
+    if (log_cmd_in_flight)
+    {
+        esp_timer_start_once(ctx.state_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
+    }
+    else
+    {
+        replay_next();
+    }
+}
+#endif
 
-static void set_state(app_state_t new_state)
+static void on_state_timeout(void *arg)
 {
-    ctx.state = new_state;
+    lock();
     switch (ctx.state)
     {
-    case APP_STATE_DISCONNECTED:
-        ledmgr_on_disconnected();
+    case APP_STATE_SPP_LINGER:
+#if CONFIG_VLINK_DATALOG
+        if (datalog_is_available())
+        {
+            ESP_LOGI(TAG, "No client within %d s, logging on the SPP session",
+                     CONFIG_VLINK_LINGER_SECS);
+            start_logging();
+            break;
+        }
+#endif
+        ESP_LOGI(TAG, "No client within %d s, closing SPP session",
+                 CONFIG_VLINK_LINGER_SECS);
+        set_state(APP_STATE_DISCONNECTED);
+        sppcomm_disconnect();
         break;
-    case APP_STATE_GATT_CONNECTED:
-        ledmgr_on_connecting();
+    case APP_STATE_SPP_REPLAYING:
+        ESP_LOGW(TAG, "No prompt after replayed command");
+        replay_next();
         break;
     case APP_STATE_GATT_SPP_CONNECTED:
-        ledmgr_on_connected();
+        if (ctx.monitor_phase == MONITOR_PHASE_RUNNING)
+        {
+            monitor_flush();
+        }
+        else if (ctx.monitor_phase != MONITOR_PHASE_OFF)
+        {
+            ESP_LOGW(TAG, "No prompt after monitor command");
+            advance_monitor();
+        }
+        else if (probe_get_mode() == PROBE_MODE_SPP)
+        {
+            ESP_LOGW(TAG, "No prompt after probe command");
+            probe_on_cmd_done(false);
+            send_probe_cmd();
+        }
+#if HOLD_CLIENT_LINES
+        else if (ctx.injecting)
+        {
+            ESP_LOGW(TAG, "No prompt after bridge command");
+            finish_injection();
+        }
+#endif
+        break;
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_DISCONNECTED:
+        if (datalog_is_available())
+        {
+            ESP_LOGI(TAG, "No client, connecting to the adapter for logging");
+            set_state(APP_STATE_LOG_CONNECTING);
+            sppcomm_connect();
+        }
+        break;
+    case APP_STATE_LOGGING:
+        if (ctx.log_cmd_in_flight)
+        {
+            ESP_LOGW(TAG, "No prompt after log command");
+        }
+        send_log_cmd();
+        break;
+    case APP_STATE_LOG_CONNECTING:
+        break;
+#else
+    case APP_STATE_DISCONNECTED:
+        break;
+#endif
+    case APP_STATE_GATT_CONNECTED:
+    case APP_STATE_SPP_RECONNECTING:
         break;
     }
+    unlock();
 }
 
-static void log_txrx(const char *prefix, const uint8_t *data, uint16_t length)
+static void on_stall_timeout(void *arg)
 {
-    static char buffer[256];
-    if (length > sizeof(buffer) - 1)
+    lock();
+    if (ctx.cancelling)
     {
-        length = sizeof(buffer) - 1;
+        ESP_LOGW(TAG, "No prompt after interrupting stalled command");
+        ctx.stalls_unrecovered++;
+        finish_cancel();
     }
-    for (int i = 0; i < length; i++)
+    else if (ctx.cmd_in_flight && ctx.state == APP_STATE_GATT_SPP_CONNECTED)
     {
-        buffer[i] = (data[i] >= 32 && data[i] <= 126) ? data[i] : '.';
+        ESP_LOGW(TAG, "No adapter output for %d ms, interrupting command",
+                 CONFIG_VLINK_CMD_STALL_TIMEOUT_MS);
+        ctx.stalls++;
+        set_cmd_in_flight(false, false);
+#if CONFIG_VLINK_COALESCE_REQUESTS
+        // Client data is held from here on, the repeat's start goes first
+        hold_duplicate_prefix();
+#endif
+        ctx.cancelling = true;
+        // Any character stops the ELM327, it then shows its prompt
+        sppcomm_tx((const uint8_t *)" ", 1);
+        esp_timer_start_once(ctx.stall_timer, REPLAY_STEP_TIMEOUT_MS * 1000);
     }
-    buffer[length] = 0;
-    ESP_LOGI(TAG, "%s %s", prefix, buffer);
+    unlock();
 }
 
 void panic(panic_id_t id)
@@ -65,116 +1410,573 @@ void panic(panic_id_t id)
     }
 }
 
-void app_on_gatt_connected(void)
+static void handle_spp_connected(void)
 {
-    ctx.initial_spp_tx_buffer_len = 0;
+    lock();
     switch (ctx.state)
     {
     case APP_STATE_DISCONNECTED:
-        set_state(APP_STATE_GATT_CONNECTED);
-        sppcomm_connect();
+    case APP_STATE_SPP_LINGER:
+        sppcomm_disconnect();
         break;
     case APP_STATE_GATT_CONNECTED:
+        set_state(APP_STATE_GATT_SPP_CONNECTED);
+        start_session_trackers();
+        release_held_client_data();
+        break;
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+        start_logging();
+        break;
+    case APP_STATE_LOGGING:
+        break;
+#endif
+    case APP_STATE_SPP_RECONNECTING:
+        ESP_LOGI(TAG, "SPP reconnected, replaying %d settings", elmcfg_count());
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+        elmtiming_on_adapter_reset();
+#endif
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+        elmfmt_on_adapter_reset();
+#endif
+        ctx.replay_index = 0;
+        set_state(APP_STATE_SPP_REPLAYING);
+        replay_next();
+        break;
     case APP_STATE_GATT_SPP_CONNECTED:
+    case APP_STATE_SPP_REPLAYING:
         break;
     }
+    unlock();
 }
 
-void app_on_gatt_disconnected(void)
+static void handle_spp_connect_error(void)
 {
-    set_state(APP_STATE_DISCONNECTED);
-    sppcomm_disconnect();
+    lock();
+    switch (ctx.state)
+    {
+    case APP_STATE_DISCONNECTED:
+        break;
+    case APP_STATE_SPP_LINGER:
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+    case APP_STATE_LOGGING:
+#endif
+        set_state(APP_STATE_DISCONNECTED);
+        break;
+    case APP_STATE_SPP_RECONNECTING:
+    case APP_STATE_SPP_REPLAYING:
+        retry_reconnect();
+        break;
+    case APP_STATE_GATT_CONNECTED:
+    case APP_STATE_GATT_SPP_CONNECTED:
+        set_state(APP_STATE_DISCONNECTED);
+        gattcomm_disconnect();
+        break;
+    }
+    unlock();
 }
 
-void app_on_gatt_rx(const uint8_t *data, uint16_t length)
+static void handle_spp_disconnected(void)
 {
-    log_txrx("GATT-->ME   SPP", data, length);
-    ledmgr_on_activity();
+    lock();
     switch (ctx.state)
     {
     case APP_STATE_DISCONNECTED:
         break;
-    case APP_STATE_GATT_CONNECTED:
-        if (ctx.initial_spp_tx_buffer_len + length > sizeof(ctx.initial_spp_tx_buffer))
+    case APP_STATE_SPP_LINGER:
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+    case APP_STATE_LOGGING:
+#endif
+        set_state(APP_STATE_DISCONNECTED);
+        break;
+    case APP_STATE_SPP_RECONNECTING:
+    case APP_STATE_SPP_REPLAYING:
+        retry_reconnect();
+        break;
+    case APP_STATE_GATT_SPP_CONNECTED:
+        if (CONFIG_VLINK_SPP_RECONNECT_ATTEMPTS > 0)
         {
-            sppcomm_disconnect();
-            gattcomm_disconnect();
-            set_state(APP_STATE_DISCONNECTED);
+            start_reconnect();
         }
         else
         {
-            memcpy(ctx.initial_spp_tx_buffer + ctx.initial_spp_tx_buffer_len,
-                   data,
-                   length);
-            ctx.initial_spp_tx_buffer_len += length;
+            set_state(APP_STATE_DISCONNECTED);
+            gattcomm_disconnect();
         }
         break;
-    case APP_STATE_GATT_SPP_CONNECTED:
-        log_txrx("GATT   ME-->SPP", data, length);
-        sppcomm_tx(data, length);
+    case APP_STATE_GATT_CONNECTED:
+        set_state(APP_STATE_DISCONNECTED);
+        gattcomm_disconnect();
         break;
     }
+    unlock();
 }
 
-void app_on_spp_connected(void)
+static void handle_spp_rx(const uint8_t *data, uint16_t length)
 {
+    lock();
+    log_txrx("GATT   ME<--SPP", data, length);
+    ledmgr_on_activity();
+    bool has_prompt = memchr(data, '>', length) != NULL;
+    if (has_prompt)
+    {
+        set_cmd_in_flight(false, true);
+    }
+    else if (ctx.cmd_in_flight)
+    {
+        check_searching(data, length);
+        restart_stall_timer();
+    }
     switch (ctx.state)
     {
-    case APP_STATE_DISCONNECTED:
-        sppcomm_disconnect();
+    case APP_STATE_GATT_SPP_CONNECTED:
+        if (ctx.monitor_phase != MONITOR_PHASE_OFF)
+        {
+            on_monitor_rx(data, length, has_prompt);
+            break;
+        }
+        // Probe replies are not forwarded
+        if (probe_get_mode() != PROBE_MODE_OFF)
+        {
+            if (has_prompt && probe_get_mode() == PROBE_MODE_SPP)
+            {
+                probe_on_cmd_done(true);
+                send_probe_cmd();
+            }
+            break;
+        }
+        // Output of the interrupted command is dropped
+        if (ctx.cancelling)
+        {
+            if (has_prompt)
+            {
+                finish_cancel();
+            }
+            break;
+        }
+#if HOLD_CLIENT_LINES
+        // Replies to bridge commands are not forwarded
+        if (ctx.injecting)
+        {
+            if (has_prompt)
+            {
+                finish_injection();
+            }
+            break;
+        }
+#endif
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+        elmtiming_on_rx(data, length);
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+        respcount_on_rx(data, length);
+        forward_restoring_echo(data, length);
+#else
+        forward_adapter_output(data, length);
+#endif
+#if CONFIG_VLINK_COALESCE_REQUESTS
+        if (has_prompt)
+        {
+            finish_coalescing();
+        }
+#endif
         break;
-    case APP_STATE_GATT_CONNECTED:
-        set_state(APP_STATE_GATT_SPP_CONNECTED);
-        if (ctx.initial_spp_tx_buffer_len > 0)
+    case APP_STATE_SPP_REPLAYING:
+        // Replies to replayed commands are not forwarded
+        if (has_prompt)
         {
-            log_txrx("GATT   ME-->SPP",
-                     ctx.initial_spp_tx_buffer,
-                     ctx.initial_spp_tx_buffer_len);
-            sppcomm_tx(ctx.initial_spp_tx_buffer,
-                       ctx.initial_spp_tx_buffer_len);
-            ctx.initial_spp_tx_buffer_len = 0;
+            esp_timer_stop(ctx.state_timer);
+            replay_next();
         }
         break;
-    case APP_STATE_GATT_SPP_CONNECTED:
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOGGING:
+        datalog_on_rx(data, length);
+        if (has_prompt && ctx.log_cmd_in_flight)
+        {
+            send_log_cmd();
+        }
+        break;
+    case APP_STATE_LOG_CONNECTING:
+#endif
+    case APP_STATE_DISCONNECTED:
+    case APP_STATE_GATT_CONNECTED:
+    case APP_STATE_SPP_LINGER:
+    case APP_STATE_SPP_RECONNECTING:
         break;
     }
+    unlock();
 }
 
-void app_on_spp_connect_error(void)
+// Takes length bytes from the stream buffer, passing them on if forward
+static void receive_spp_rx(size_t length, bool forward)
+{
+    while (length > 0)
+    {
+        size_t chunk = length < sizeof(ctx.spp_rx_chunk) ? length : sizeof(ctx.spp_rx_chunk);
+        size_t received = xStreamBufferReceive(ctx.spp_rx, ctx.spp_rx_chunk, chunk, 0);
+        if (received == 0)
+        {
+            break;
+        }
+        if (forward)
+        {
+            handle_spp_rx(ctx.spp_rx_chunk, received);
+        }
+        length -= received;
+    }
+}
+
+static void bridge_task(void *arg)
+{
+    while (true)
+    {
+        spp_event_t event;
+        xQueueReceive(ctx.spp_events, &event, portMAX_DELAY);
+        // It may belong to a connection that is already gone
+        receive_spp_rx(event.skip, false);
+        switch (event.type)
+        {
+        case SPP_EVENT_CONNECTED:
+            handle_spp_connected();
+            break;
+        case SPP_EVENT_CONNECT_ERROR:
+            handle_spp_connect_error();
+            break;
+        case SPP_EVENT_DISCONNECTED:
+            handle_spp_disconnected();
+            break;
+        case SPP_EVENT_RX:
+            receive_spp_rx(event.length, true);
+            break;
+        }
+    }
+}
+
+void app_init(void)
+{
+    esp_err_t err;
+
+    ctx.lock = xSemaphoreCreateRecursiveMutexStatic(&ctx.lock_buffer);
+    if (ctx.lock == NULL)
+    {
+        ESP_LOGE(TAG, "xSemaphoreCreateRecursiveMutexStatic failed");
+        panic(PANIC_ID_APP_CREATE_MUTEX_FAILED);
+    }
+
+    ctx.spp_events = xQueueCreateStatic(SPP_EVENT_QUEUE_LEN,
+                                        sizeof(spp_event_t),
+                                        ctx.spp_events_storage,
+                                        &ctx.spp_events_buffer);
+    ctx.spp_rx = xStreamBufferCreateStatic(CONFIG_VLINK_BRIDGE_RX_BUFFER,
+                                           1,
+                                           ctx.spp_rx_storage,
+                                           &ctx.spp_rx_buffer);
+    if (ctx.spp_events == NULL || ctx.spp_rx == NULL)
+    {
+        ESP_LOGE(TAG, "Bridge queue creation failed");
+        panic(PANIC_ID_APP_QUEUE_CREATE_FAILED);
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = on_state_timeout,
+        .name = "app_state",
+    };
+    err = esp_timer_create(&timer_args, &ctx.state_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(PANIC_ID_APP_TIMER_CREATE_FAILED);
+    }
+
+    const esp_timer_create_args_t stall_timer_args = {
+        .callback = on_stall_timeout,
+        .name = "app_stall",
+    };
+    err = esp_timer_create(&stall_timer_args, &ctx.stall_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(PANIC_ID_APP_TIMER_CREATE_FAILED);
+    }
+
+    ctx.bridge_task = xTaskCreateStaticPinnedToCore(bridge_task,
+                                                    "bridge",
+                                                    BRIDGE_TASK_STACK_SIZE,
+                                                    NULL,
+                                                    CONFIG_VLINK_BRIDGE_TASK_PRIORITY,
+                                                    ctx.bridge_task_stack,
+                                                    &ctx.bridge_task_buffer,
+                                                    CONFIG_VLINK_BRIDGE_TASK_CORE);
+    if (ctx.bridge_task == NULL)
+    {
+        ESP_LOGE(TAG, "xTaskCreateStaticPinnedToCore failed");
+        panic(PANIC_ID_APP_TASK_CREATE_FAILED);
+    }
+
+#if CONFIG_VLINK_DATALOG
+    esp_timer_start_once(ctx.state_timer, CONFIG_VLINK_DATALOG_START_DELAY_S * 1000000ULL);
+#endif
+}
+
+bool app_on_control(const uint8_t *data, uint16_t length)
+{
+    char cmd[CONTROL_CMD_MAX_LEN];
+    if (length >= sizeof(cmd))
+    {
+        return false;
+    }
+    for (uint16_t i = 0; i < length; i++)
+    {
+        cmd[i] = toupper(data[i]);
+    }
+    cmd[length] = '\0';
+    ESP_LOGI(TAG, "Control: %s", cmd);
+
+    bool ok = false;
+    lock();
+    if (strcmp(cmd, "MONITOR OFF") == 0)
+    {
+        stop_monitor();
+        ok = true;
+    }
+    else if (strncmp(cmd, "MONITOR", 7) == 0)
+    {
+        // "MONITOR 7E8,7E9", without IDs every frame is passed on
+        ok = start_monitor(cmd + 7, length - 7);
+    }
+    else if (strcmp(cmd, "PROBE OFF") == 0)
+    {
+        probe_stop();
+        ok = true;
+    }
+    else if (strncmp(cmd, "PROBE", 5) == 0)
+    {
+        ok = start_probe(cmd + 5, length - 5);
+    }
+    else if (strncmp(cmd, "STATS ", 6) == 0 && isdigit((unsigned char)cmd[6]) && cmd[7] == '\0')
+    {
+        ok = stats_select_page(cmd[6] - '0');
+    }
+#if CONFIG_VLINK_BLE_COMPRESSION
+    else if (strcmp(cmd, "COMPRESS ON") == 0)
+    {
+        ok = set_compression(true);
+    }
+    else if (strcmp(cmd, "COMPRESS OFF") == 0)
+    {
+        ok = set_compression(false);
+    }
+#endif
+#if CONFIG_VLINK_DATALOG
+    else if (strcmp(cmd, "LOG CLEAR") == 0)
+    {
+        ok = datalog_clear();
+    }
+    else if (strcmp(cmd, "LOG") == 0)
+    {
+        ok = datalog_send();
+    }
+#endif
+    unlock();
+    return ok;
+}
+
+void app_on_probe_flood(void)
+{
+    lock();
+    probe_flood();
+    unlock();
+}
+
+void app_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "stalls=%"PRIu32"/%"PRIu32"\n", ctx.stalls, ctx.stalls_unrecovered);
+    portENTER_CRITICAL(&spp_drops_mux);
+    uint32_t rx_dropped = ctx.spp_rx_dropped;
+    uint32_t events_dropped = ctx.spp_events_dropped;
+    portEXIT_CRITICAL(&spp_drops_mux);
+    if (rx_dropped > 0 || events_dropped > 0)
+    {
+        stats_printf(writer, "bridge_drops=%"PRIu32"B/%"PRIu32"\n", rx_dropped, events_dropped);
+    }
+#if CONFIG_VLINK_COALESCE_REQUESTS
+    stats_printf(writer, "coalesced=%"PRIu32"\n", ctx.coalesced);
+#endif
+}
+
+void app_on_gatt_connected(void)
 {
+    lock();
+    clear_initial_spp_tx();
+    ctx.client_cmd_len = 0;
+    set_cmd_in_flight(false, false);
     switch (ctx.state)
     {
     case APP_STATE_DISCONNECTED:
+        elmcfg_reset();
+        set_state(APP_STATE_GATT_CONNECTED);
+        sppcomm_connect();
+        break;
+    case APP_STATE_SPP_LINGER:
+        ESP_LOGI(TAG, "Client reconnected, resuming SPP session");
+        set_state(APP_STATE_GATT_SPP_CONNECTED);
         break;
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+        // The adapter link being set up goes to the client
+        elmcfg_reset();
+        set_state(APP_STATE_GATT_CONNECTED);
+        break;
+    case APP_STATE_LOGGING:
+        hand_over_logging();
+        break;
+#endif
     case APP_STATE_GATT_CONNECTED:
     case APP_STATE_GATT_SPP_CONNECTED:
+    case APP_STATE_SPP_RECONNECTING:
+    case APP_STATE_SPP_REPLAYING:
+        break;
+    }
+    unlock();
+}
+
+void app_on_gatt_disconnected(void)
+{
+    lock();
+    switch (ctx.state)
+    {
+    case APP_STATE_GATT_SPP_CONNECTED:
+        // A monitoring adapter is not worth keeping for the next client
+        if (CONFIG_VLINK_LINGER_SECS > 0 && ctx.monitor_phase == MONITOR_PHASE_OFF)
+        {
+            ESP_LOGI(TAG, "Keeping SPP session for %d s", CONFIG_VLINK_LINGER_SECS);
+            set_state(APP_STATE_SPP_LINGER);
+        }
+        else
+        {
+            set_state(APP_STATE_DISCONNECTED);
+            sppcomm_disconnect();
+        }
+        break;
+    case APP_STATE_DISCONNECTED:
+    case APP_STATE_GATT_CONNECTED:
+    case APP_STATE_SPP_LINGER:
+    case APP_STATE_SPP_RECONNECTING:
+    case APP_STATE_SPP_REPLAYING:
         set_state(APP_STATE_DISCONNECTED);
-        gattcomm_disconnect();
+        sppcomm_disconnect();
         break;
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+    case APP_STATE_LOGGING:
+        break;
+#endif
     }
+    unlock();
 }
 
-void app_on_spp_disconnected(void)
+bool app_on_gatt_rx(const uint8_t *data, uint16_t length)
 {
+    bool accepted = true;
+    lock();
+    ctx.client_rx_time = esp_timer_get_time();
+    log_txrx("GATT-->ME   SPP", data, length);
+    ledmgr_on_activity();
+    probe_mode_t probe_mode = probe_get_mode();
+    if (probe_mode != PROBE_MODE_OFF && probe_mode != PROBE_MODE_SPP)
+    {
+        // GATT probes never reach the adapter
+        probe_on_gatt_rx(data, length);
+        ctx.client_rx_time = 0;
+        unlock();
+        return true;
+    }
     switch (ctx.state)
     {
     case APP_STATE_DISCONNECTED:
+    case APP_STATE_SPP_LINGER:
+#if CONFIG_VLINK_DATALOG
+    case APP_STATE_LOG_CONNECTING:
+    case APP_STATE_LOGGING:
+#endif
         break;
     case APP_STATE_GATT_CONNECTED:
+    case APP_STATE_SPP_RECONNECTING:
+    case APP_STATE_SPP_REPLAYING:
+        accepted = hold_client_data(data, length);
+        break;
     case APP_STATE_GATT_SPP_CONNECTED:
-        set_state(APP_STATE_DISCONNECTED);
-        gattcomm_disconnect();
+        if (ctx.cancelling || ctx.monitor_phase != MONITOR_PHASE_OFF || probe_mode == PROBE_MODE_SPP)
+        {
+            // Sent once the adapter is back at its prompt
+            accepted = hold_client_data(data, length);
+            break;
+        }
+#if HOLD_CLIENT_LINES
+        accepted = forward_client_data(data, length);
+#else
+        spp_tx_from_client(data, length);
+#endif
         break;
     }
+    ctx.client_rx_time = 0;
+    unlock();
+    return accepted;
+}
+
+static bool post_spp_event(spp_event_type_t type, uint16_t length)
+{
+    const spp_event_t event = {
+        .type = type,
+        .length = length,
+        .skip = ctx.spp_rx_orphaned,
+    };
+    if (xQueueSend(ctx.spp_events, &event, pdMS_TO_TICKS(SPP_POST_TIMEOUT_MS)) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "SPP event %d dropped", type);
+        portENTER_CRITICAL(&spp_drops_mux);
+        ctx.spp_events_dropped++;
+        portEXIT_CRITICAL(&spp_drops_mux);
+        return false;
+    }
+    ctx.spp_rx_orphaned = 0;
+    return true;
+}
+
+void app_on_spp_connected(void)
+{
+    post_spp_event(SPP_EVENT_CONNECTED, 0);
+}
+
+void app_on_spp_connect_error(void)
+{
+    post_spp_event(SPP_EVENT_CONNECT_ERROR, 0);
+}
+
+void app_on_spp_disconnected(void)
+{
+    post_spp_event(SPP_EVENT_DISCONNECTED, 0);
 }
 
 void app_on_spp_rx(const uint8_t *data, uint16_t length)
 {
-    log_txrx("GATT   ME<--SPP", data, length);
-    ledmgr_on_activity();
-    if (ctx.state == APP_STATE_GATT_SPP_CONNECTED)
+    // Copied out of the Bluedroid task, parsed and forwarded on the bridge core
+    size_t sent = xStreamBufferSend(ctx.spp_rx, data, length, pdMS_TO_TICKS(SPP_POST_TIMEOUT_MS));
+    if (sent < length)
+    {
+        ESP_LOGE(TAG, "Adapter data dropped: %d bytes", (int)(length - sent));
+        portENTER_CRITICAL(&spp_drops_mux);
+        ctx.spp_rx_dropped += length - sent;
+        portEXIT_CRITICAL(&spp_drops_mux);
+    }
+    if (sent > 0 && !post_spp_event(SPP_EVENT_RX, sent))
     {
-        log_txrx("GATT<--ME   SPP", data, length);
-        gattcomm_tx(data, length);
+        ctx.spp_rx_orphaned += sent;
+        portENTER_CRITICAL(&spp_drops_mux);
+        ctx.spp_rx_dropped += sent;
+        portEXIT_CRITICAL(&spp_drops_mux);
     }
 }
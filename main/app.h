@@ -1,10 +1,14 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
 
 #define BT_DEVICE_NAME "V-LINK Adapter"
 
 typedef enum
 {
+    // The LED blinks these values, existing ones keep their number: new
+    // IDs go at the end and removed ones leave a reserved slot
     PANIC_ID_NONE = 0,
 
     PANIC_ID_MAIN_NVS_FLASH_ERASE_FAILED,
@@ -31,17 +35,52 @@ typedef enum
 
     PANIC_ID_LEDMGR_LEDC_TIMER_CONFIG_FAILED,
     PANIC_ID_LEDMGR_LEDC_CHANNEL_CONFIG_FAILED,
-    PANIC_ID_LEDMGR_CREATE_QUEUE_FAILED,
+    // Was PANIC_ID_LEDMGR_CREATE_QUEUE_FAILED
+    PANIC_ID_RESERVED_23,
     PANIC_ID_LEDMGR_TASK_CREATE_FAILED,
+
+    PANIC_ID_GATTCOMM_SET_SECURITY_PARAM_FAILED,
+    PANIC_ID_GATTCOMM_TIMER_CREATE_FAILED,
+
+    PANIC_ID_APP_CREATE_MUTEX_FAILED,
+    PANIC_ID_APP_TIMER_CREATE_FAILED,
+
+    PANIC_ID_LEDMGR_LEDC_BLINK_TIMER_CONFIG_FAILED,
+    PANIC_ID_LEDMGR_LEDC_FADE_INSTALL_FAILED,
+
+    PANIC_ID_PWRMGR_PM_CONFIGURE_FAILED,
+    PANIC_ID_PWRMGR_LOCK_CREATE_FAILED,
+    PANIC_ID_PWRMGR_TIMER_CREATE_FAILED,
+
+    PANIC_ID_MAIN_NVS_TASK_CREATE_FAILED,
+
+    PANIC_ID_STATS_TIMER_CREATE_FAILED,
+
+    PANIC_ID_APP_QUEUE_CREATE_FAILED,
+    PANIC_ID_APP_TASK_CREATE_FAILED,
+
+    PANIC_ID_DATALOG_CREATE_MUTEX_FAILED,
+    PANIC_ID_DATALOG_TIMER_CREATE_FAILED,
+
+    PANIC_ID_GATTCOMM_CREATE_MUTEX_FAILED,
 } panic_id_t;
 
 __attribute__((noreturn)) void panic(panic_id_t id);
 
+void app_init(void);
+
 void app_on_gatt_connected(void);
 void app_on_gatt_disconnected(void);
-void app_on_gatt_rx(const uint8_t *data, uint16_t length);
+// Returns false to hold the client off until gattcomm_resume_rx()
+bool app_on_gatt_rx(const uint8_t *data, uint16_t length);
+// Bridge commands written to the control characteristic
+bool app_on_control(const uint8_t *data, uint16_t length);
+// Flood probe timer tick
+void app_on_probe_flood(void);
 
 void app_on_spp_connected(void);
 void app_on_spp_connect_error(void);
 void app_on_spp_disconnected(void);
 void app_on_spp_rx(const uint8_t *data, uint16_t length);
+
+void app_write_stats(stats_writer_t *writer);
@@ -0,0 +1,81 @@
+#include "bootprof.h"
+
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "BOOTPROF"
+
+static const char *const BOOT_PHASE_NAMES[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_APP_MAIN] = "main",
+    [BOOT_PHASE_NVS_READY] = "nvs",
+    [BOOT_PHASE_CONTROLLER_ENABLED] = "controller",
+    [BOOT_PHASE_BLUEDROID_ENABLED] = "bluedroid",
+    [BOOT_PHASE_GATTS_REGISTERED] = "gatts",
+    [BOOT_PHASE_ADV_DATA_SET] = "adv_data",
+    [BOOT_PHASE_GATT_SERVICE_READY] = "service",
+    [BOOT_PHASE_SPP_READY] = "spp",
+    [BOOT_PHASE_ADV_STARTED] = "adv",
+    [BOOT_PHASE_FIRST_CONNECT] = "connect",
+};
+
+static struct
+{
+    // Microseconds since the esp_timer started early in the startup code,
+    // the bootloader is not included. Zero until the phase is reached.
+    int64_t phase_time_us[BOOT_PHASE_COUNT];
+} ctx;
+
+void bootprof_mark(boot_phase_t phase)
+{
+    // Only the first occurrence is of interest, e.g. advertising restarts
+    // after every disconnect
+    if (ctx.phase_time_us[phase] != 0)
+    {
+        return;
+    }
+
+    ctx.phase_time_us[phase] = esp_timer_get_time();
+    ESP_LOGI(TAG, "Boot phase %s at %"PRId64" us",
+             BOOT_PHASE_NAMES[phase],
+             ctx.phase_time_us[phase]);
+
+    if (phase == BOOT_PHASE_ADV_STARTED)
+    {
+        bootprof_log();
+    }
+}
+
+void bootprof_log(void)
+{
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++)
+    {
+        if (ctx.phase_time_us[i] != 0)
+        {
+            ESP_LOGI(TAG, "%-20s %6"PRId64" ms",
+                     BOOT_PHASE_NAMES[i],
+                     ctx.phase_time_us[i] / 1000);
+        }
+    }
+}
+
+void bootprof_write_stats(stats_writer_t *writer)
+{
+    // The stats characteristic is limited to 512 bytes, keep it compact
+    stats_printf(writer, "boot_ms=");
+    const char *separator = "";
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++)
+    {
+        if (ctx.phase_time_us[i] != 0)
+        {
+            stats_printf(writer, "%s%s:%"PRId64,
+                         separator,
+                         BOOT_PHASE_NAMES[i],
+                         ctx.phase_time_us[i] / 1000);
+            separator = ",";
+        }
+    }
+    stats_printf(writer, "\n");
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "stats.h"
+
+typedef enum
+{
+    BOOT_PHASE_APP_MAIN,
+    BOOT_PHASE_NVS_READY,
+    BOOT_PHASE_CONTROLLER_ENABLED,
+    BOOT_PHASE_BLUEDROID_ENABLED,
+    BOOT_PHASE_GATTS_REGISTERED,
+    BOOT_PHASE_ADV_DATA_SET,
+    BOOT_PHASE_GATT_SERVICE_READY,
+    BOOT_PHASE_SPP_READY,
+    BOOT_PHASE_ADV_STARTED,
+    BOOT_PHASE_FIRST_CONNECT,
+    BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+void bootprof_mark(boot_phase_t phase);
+void bootprof_log(void);
+void bootprof_write_stats(stats_writer_t *writer);
@@ -0,0 +1,72 @@
+#include "bufpool.h"
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <freertos/FreeRTOS.h>
+
+static struct
+{
+    portMUX_TYPE mux;
+    bufpool_buf_t blocks[CONFIG_VLINK_BUFPOOL_BLOCKS];
+    bufpool_buf_t *free_list;
+    uint32_t in_use;
+    uint32_t peak_in_use;
+    uint32_t alloc_failures;
+} ctx = {
+    .mux = portMUX_INITIALIZER_UNLOCKED,
+};
+
+void bufpool_init(void)
+{
+    for (int i = 0; i < CONFIG_VLINK_BUFPOOL_BLOCKS; i++)
+    {
+        ctx.blocks[i].next = ctx.free_list;
+        ctx.free_list = &ctx.blocks[i];
+    }
+}
+
+bufpool_buf_t *bufpool_alloc(void)
+{
+    taskENTER_CRITICAL(&ctx.mux);
+    bufpool_buf_t *buf = ctx.free_list;
+    if (buf != NULL)
+    {
+        ctx.free_list = buf->next;
+        ctx.in_use++;
+        if (ctx.in_use > ctx.peak_in_use)
+        {
+            ctx.peak_in_use = ctx.in_use;
+        }
+    }
+    else
+    {
+        ctx.alloc_failures++;
+    }
+    taskEXIT_CRITICAL(&ctx.mux);
+
+    if (buf != NULL)
+    {
+        buf->next = NULL;
+        buf->length = 0;
+    }
+    return buf;
+}
+
+void bufpool_free(bufpool_buf_t *buf)
+{
+    taskENTER_CRITICAL(&ctx.mux);
+    buf->next = ctx.free_list;
+    ctx.free_list = buf;
+    ctx.in_use--;
+    taskEXIT_CRITICAL(&ctx.mux);
+}
+
+void bufpool_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "bufpool=%"PRIu32"/%d peak=%"PRIu32" fail=%"PRIu32"\n",
+                 ctx.in_use,
+                 CONFIG_VLINK_BUFPOOL_BLOCKS,
+                 ctx.peak_in_use,
+                 ctx.alloc_failures);
+}
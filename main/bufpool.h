@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+#include "stats.h"
+
+// Fits a full write at the local MTU
+#define BUFPOOL_BLOCK_SIZE 512
+
+typedef struct bufpool_buf
+{
+    struct bufpool_buf *next;
+    uint16_t length;
+    uint8_t data[BUFPOOL_BLOCK_SIZE];
+} bufpool_buf_t;
+
+void bufpool_init(void);
+bufpool_buf_t *bufpool_alloc(void);
+void bufpool_free(bufpool_buf_t *buf);
+void bufpool_write_stats(stats_writer_t *writer);
@@ -0,0 +1,103 @@
+#include "coex.h"
+
+#include <string.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+#include <esp_gap_ble_api.h>
+#include <esp_gap_bt_api.h>
+
+#define TAG "COEX"
+
+// BLE intervals are in 1.25 ms units. Minimum and maximum are at least
+// 15 ms apart, as iOS requires, or the request is rejected.
+// SPP poll intervals are in 625 us slots.
+#if CONFIG_VLINK_COEX_PROFILE_LOW_LATENCY
+#define PROFILE_NAME     "low-latency"
+#define BLE_MIN_INTERVAL 12
+#define BLE_MAX_INTERVAL 24
+#define BLE_LATENCY      0
+#define SPP_TPOLL        ESP_BT_GAP_TPOLL_MIN
+#define AUTO_LATENCY     false
+#elif CONFIG_VLINK_COEX_PROFILE_BLE_PRIORITY
+#define PROFILE_NAME     "ble"
+#define BLE_MIN_INTERVAL 12
+#define BLE_MAX_INTERVAL 24
+#define BLE_LATENCY      0
+#define SPP_TPOLL        (2 * ESP_BT_GAP_TPOLL_DFT)
+#define AUTO_LATENCY     false
+#elif CONFIG_VLINK_COEX_PROFILE_CLASSIC_PRIORITY
+#define PROFILE_NAME     "classic"
+#define BLE_MIN_INTERVAL 24
+#define BLE_MAX_INTERVAL 48
+#define BLE_LATENCY      0
+#define SPP_TPOLL        ESP_BT_GAP_TPOLL_MIN
+#define AUTO_LATENCY     true
+#else
+#define PROFILE_NAME     "default"
+#define SPP_TPOLL        ESP_BT_GAP_TPOLL_DFT
+#endif
+// 4 s in 10 ms units
+#define BLE_SUPERVISION_TIMEOUT 400
+
+static struct
+{
+    // Negotiated with the client, 0 until known
+    uint16_t ble_interval;
+    uint16_t ble_latency;
+} ctx;
+
+void coex_configure_controller(esp_bt_controller_config_t *cfg)
+{
+#ifdef AUTO_LATENCY
+    // BLE skips connection events while classic traffic is pending
+    cfg->auto_latency = AUTO_LATENCY;
+#endif
+    ESP_LOGI(TAG, "Scheduling profile %s", PROFILE_NAME);
+}
+
+void coex_on_ble_connected(const uint8_t *remote_bda)
+{
+    ctx.ble_interval = 0;
+    ctx.ble_latency = 0;
+#ifdef BLE_MIN_INTERVAL
+    esp_ble_conn_update_params_t params = {
+        .min_int = BLE_MIN_INTERVAL,
+        .max_int = BLE_MAX_INTERVAL,
+        .latency = BLE_LATENCY,
+        .timeout = BLE_SUPERVISION_TIMEOUT,
+    };
+    memcpy(params.bda, remote_bda, sizeof(params.bda));
+    esp_err_t err = esp_ble_gap_update_conn_params(&params);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gap_update_conn_params failed: %d", err);
+    }
+#endif
+}
+
+void coex_on_ble_conn_params(uint16_t interval, uint16_t latency)
+{
+    ESP_LOGI(TAG, "BLE interval %"PRIu32" us, latency %d", (uint32_t)interval * 1250, latency);
+    ctx.ble_interval = interval;
+    ctx.ble_latency = latency;
+}
+
+uint32_t coex_get_spp_tpoll(void)
+{
+    return SPP_TPOLL;
+}
+
+uint16_t coex_get_ble_interval(void)
+{
+    return ctx.ble_interval;
+}
+
+void coex_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "coex=%s ble_int:%"PRIu32"us lat:%d tpoll:%d\n",
+                 PROFILE_NAME,
+                 (uint32_t)ctx.ble_interval * 1250,
+                 ctx.ble_latency,
+                 (int)SPP_TPOLL);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include "stats.h"
+
+#include <esp_bt.h>
+
+void coex_configure_controller(esp_bt_controller_config_t *cfg);
+void coex_on_ble_connected(const uint8_t *remote_bda);
+void coex_on_ble_conn_params(uint16_t interval, uint16_t latency);
+// Poll interval of the active SPP link in slots
+uint32_t coex_get_spp_tpoll(void);
+// Connection interval of the client in 1.25 ms units, 0 if unknown
+uint16_t coex_get_ble_interval(void);
+void coex_write_stats(stats_writer_t *writer);
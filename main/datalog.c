@@ -0,0 +1,621 @@
+#include "datalog.h"
+#include "app.h"
+#include "gattcomm.h"
+#include "elmcfg.h"
+#include "nvsstore.h"
+
+#include <string.h>
+#include <inttypes.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+
+#if CONFIG_VLINK_DATALOG
+
+#define TAG              "DATALOG"
+#define NVS_NAMESPACE    "datalog"
+#define NVS_KEY_SENT     "sent_seq"
+#define NVS_KEY_SESSION  "session"
+#define PARTITION_LABEL  "datalog"
+
+// Each sector starts with a header, then records follow back to back.
+// Unwritten flash reads as 0xFF, which ends the records of a sector.
+#define SECTOR_SIZE      4096
+#define PAGE_SIZE        256
+#define SECTOR_MAGIC     0x474c4456
+#define HEADER_LEN       8
+#define RECORD_END       0xFF
+
+// Record length byte counting what follows, type byte, then the payload,
+// little endian
+#define RECORD_SESSION   0x01
+#define RECORD_SAMPLE    0x02
+#define MAX_REPLY_LEN    16
+#define RECORD_MAX_LEN   (2 + 4 + MAX_REPLY_LEN)
+
+#define MAX_PIDS         8
+#define PID_CMD_LEN      12
+#define LINE_MAX_LEN     (2 * MAX_REPLY_LEN)
+#define SEND_INTERVAL_MS 5
+// Notifications queued per send tick while the link is not congested
+#define SEND_BURST       4
+#define SEND_MAX_LEN     509
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+} sector_header_t;
+
+static struct
+{
+    // Called from the bridge, the BTC task and the send timer
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lock_buffer;
+    const esp_partition_t *partition;
+    uint32_t sector_count;
+
+    // Newest sector and its sequence number, 0 before the first one
+    uint32_t head_sector;
+    uint32_t head_seq;
+    // Offset of the next record in the head sector, SECTOR_SIZE once it
+    // must not take any more
+    uint32_t head_used;
+    // Newest sector the client has cleared
+    uint32_t sent_seq;
+
+    // Page being filled, written out when full or flushed. The bytes in
+    // front of page_written are already in flash.
+    uint8_t page[PAGE_SIZE];
+    uint32_t page_offset;
+    uint16_t page_len;
+    uint16_t page_written;
+    int64_t flush_time;
+
+    char pids[MAX_PIDS][PID_CMD_LEN];
+    int pid_count;
+    int step;
+    bool in_session;
+    // Replies are only recorded for PID requests
+    bool polling;
+    uint32_t session;
+    int64_t session_start;
+    char line[LINE_MAX_LEN];
+    uint16_t line_len;
+    bool line_overflow;
+
+    esp_timer_handle_t send_timer;
+    bool sending;
+    uint32_t send_seq;
+    uint32_t send_last_seq;
+    uint32_t send_offset;
+    // Where the records of the sector being sent end
+    uint32_t send_sector_end;
+    int64_t send_start;
+    uint8_t send_buffer[SEND_MAX_LEN];
+    // Newest sector of the last complete transfer, 0 for none
+    uint32_t transferred_seq;
+
+    uint32_t records;
+    uint32_t misses;
+    uint32_t erases;
+    uint32_t lost_sectors;
+    uint32_t sent_bytes;
+    uint32_t send_rate;
+} ctx;
+
+static void lock(void)
+{
+    xSemaphoreTake(ctx.lock, portMAX_DELAY);
+}
+
+static void unlock(void)
+{
+    xSemaphoreGive(ctx.lock);
+}
+
+// Sectors are written in a ring, so a sequence number maps to a sector
+// as long as it is one of the last sector_count ones
+static uint32_t oldest_seq(void)
+{
+    return ctx.head_seq >= ctx.sector_count ? ctx.head_seq - ctx.sector_count + 1 : 1;
+}
+
+static uint32_t sector_of(uint32_t seq)
+{
+    uint32_t back = (ctx.head_seq - seq) % ctx.sector_count;
+    return (ctx.head_sector + ctx.sector_count - back) % ctx.sector_count;
+}
+
+static uint32_t backlog_seq(void)
+{
+    uint32_t seq = oldest_seq();
+    return seq > ctx.sent_seq ? seq : ctx.sent_seq + 1;
+}
+
+// Reads the sector a page at a time into buffer
+static uint32_t find_sector_end(uint32_t sector, uint8_t *buffer)
+{
+    uint32_t base = sector * SECTOR_SIZE;
+    uint32_t loaded = UINT32_MAX;
+    uint32_t pos = HEADER_LEN;
+    while (pos < SECTOR_SIZE)
+    {
+        uint32_t page = pos & ~(PAGE_SIZE - 1);
+        if (page != loaded)
+        {
+            if (esp_partition_read(ctx.partition, base + page, buffer, PAGE_SIZE) != ESP_OK)
+            {
+                return SECTOR_SIZE;
+            }
+            loaded = page;
+        }
+        uint8_t length = buffer[pos - page];
+        if (length == RECORD_END)
+        {
+            return pos;
+        }
+        pos += 1 + length;
+    }
+    return SECTOR_SIZE;
+}
+
+static void scan_partition(void)
+{
+    ctx.head_seq = 0;
+    for (uint32_t sector = 0; sector < ctx.sector_count; sector++)
+    {
+        sector_header_t header;
+        esp_err_t err = esp_partition_read(ctx.partition, sector * SECTOR_SIZE, &header, sizeof(header));
+        if (err == ESP_OK && header.magic == SECTOR_MAGIC && header.seq != UINT32_MAX && header.seq > ctx.head_seq)
+        {
+            ctx.head_sector = sector;
+            ctx.head_seq = header.seq;
+        }
+    }
+
+    // A wiped partition starts over from sequence 1
+    if (ctx.sent_seq > ctx.head_seq)
+    {
+        ctx.sent_seq = ctx.head_seq;
+        nvsstore_save_u32(NVS_NAMESPACE, NVS_KEY_SENT, ctx.sent_seq);
+    }
+
+    // A sector the client has cleared is not appended to
+    ctx.head_used = SECTOR_SIZE;
+    if (ctx.head_seq > ctx.sent_seq)
+    {
+        ctx.head_used = find_sector_end(ctx.head_sector, ctx.page);
+    }
+    ctx.page_offset = ctx.head_sector * SECTOR_SIZE + (ctx.head_used & ~(PAGE_SIZE - 1));
+    ctx.page_len = ctx.head_used % PAGE_SIZE;
+    ctx.page_written = ctx.page_len;
+}
+
+static void parse_pids(const char *pids)
+{
+    ctx.pid_count = elmcfg_parse_cmd_list(pids, strlen(pids), &ctx.pids[0][0], PID_CMD_LEN, MAX_PIDS);
+    if (ctx.pid_count < 0)
+    {
+        ESP_LOGW(TAG, "Bad PID list %s", pids);
+        ctx.pid_count = 0;
+    }
+}
+
+static void write_page(void)
+{
+    if (ctx.page_len > ctx.page_written)
+    {
+        esp_err_t err = esp_partition_write(ctx.partition,
+                                            ctx.page_offset + ctx.page_written,
+                                            ctx.page + ctx.page_written,
+                                            ctx.page_len - ctx.page_written);
+        if (err)
+        {
+            ESP_LOGW(TAG, "esp_partition_write failed: %d", err);
+        }
+        ctx.page_written = ctx.page_len;
+    }
+    if (ctx.page_len == PAGE_SIZE)
+    {
+        ctx.page_offset += PAGE_SIZE;
+        ctx.page_len = 0;
+        ctx.page_written = 0;
+    }
+    ctx.flush_time = esp_timer_get_time();
+}
+
+// Erased as it is started, each sector is erased once per fill
+static bool start_sector(void)
+{
+    write_page();
+
+    uint32_t sector = ctx.head_seq == 0 ? 0 : (ctx.head_sector + 1) % ctx.sector_count;
+    uint32_t seq = ctx.head_seq + 1;
+    if (seq > ctx.sector_count && seq - ctx.sector_count > ctx.sent_seq)
+    {
+        // The oldest sector the client has not cleared is overwritten
+        ctx.lost_sectors++;
+    }
+
+    esp_err_t err = esp_partition_erase_range(ctx.partition, sector * SECTOR_SIZE, SECTOR_SIZE);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_partition_erase_range failed: %d", err);
+        return false;
+    }
+    ctx.erases++;
+
+    sector_header_t header = {
+        .magic = SECTOR_MAGIC,
+        .seq = seq,
+    };
+    err = esp_partition_write(ctx.partition, sector * SECTOR_SIZE, &header, sizeof(header));
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_partition_write failed: %d", err);
+        return false;
+    }
+
+    ctx.head_sector = sector;
+    ctx.head_seq = seq;
+    ctx.head_used = HEADER_LEN;
+    ctx.page_offset = sector * SECTOR_SIZE;
+    ctx.page_len = HEADER_LEN;
+    ctx.page_written = HEADER_LEN;
+    return true;
+}
+
+// Records never cross a sector, the rest of a full one stays erased
+static void append_record(const uint8_t *record, uint16_t length)
+{
+    if (ctx.head_seq == 0 || ctx.head_used + length > SECTOR_SIZE)
+    {
+        if (!start_sector())
+        {
+            return;
+        }
+    }
+
+    ctx.head_used += length;
+    while (length > 0)
+    {
+        uint16_t chunk = PAGE_SIZE - ctx.page_len;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(ctx.page + ctx.page_len, record, chunk);
+        ctx.page_len += chunk;
+        record += chunk;
+        length -= chunk;
+        if (ctx.page_len == PAGE_SIZE)
+        {
+            write_page();
+        }
+    }
+}
+
+static void put_u32(uint8_t *data, uint32_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+static void finish_line(void)
+{
+    int length = ctx.line_len;
+    bool overflow = ctx.line_overflow;
+    ctx.line_len = 0;
+    ctx.line_overflow = false;
+    if (!ctx.polling || length == 0)
+    {
+        return;
+    }
+
+    // "410C1AF8" with spaces and headers off, anything else is NO DATA,
+    // a protocol search or a bus error
+    uint8_t record[RECORD_MAX_LEN];
+    int n = 6;
+    bool valid = !overflow && length >= 4 && length % 2 == 0;
+    for (int i = 0; valid && i < length; i += 2)
+    {
+        int high = elmcfg_hex_value(ctx.line[i]);
+        int low = elmcfg_hex_value(ctx.line[i + 1]);
+        valid = high >= 0 && low >= 0;
+        record[n++] = high << 4 | low;
+    }
+    if (!valid)
+    {
+        ctx.misses++;
+        return;
+    }
+
+    record[0] = n - 1;
+    record[1] = RECORD_SAMPLE;
+    put_u32(record + 2, (esp_timer_get_time() - ctx.session_start) / 1000);
+    append_record(record, n);
+    ctx.records++;
+}
+
+static void finish_send(void)
+{
+    esp_timer_stop(ctx.send_timer);
+    ctx.sending = false;
+    int64_t elapsed_ms = (esp_timer_get_time() - ctx.send_start) / 1000;
+    ctx.send_rate = elapsed_ms > 0 ? ctx.sent_bytes * 1000 / elapsed_ms : 0;
+}
+
+// Sectors closed early end in erased bytes, which are not sent
+static void start_send_sector(void)
+{
+    if (ctx.send_seq == ctx.head_seq && ctx.head_used < SECTOR_SIZE)
+    {
+        ctx.send_sector_end = ctx.head_used;
+    }
+    else
+    {
+        ctx.send_sector_end = find_sector_end(sector_of(ctx.send_seq), ctx.send_buffer);
+    }
+    ctx.send_offset = HEADER_LEN;
+}
+
+static void on_send_timer(void *arg)
+{
+    lock();
+    for (int i = 0; i < SEND_BURST && ctx.sending && !gattcomm_is_congested(); i++)
+    {
+        while (ctx.send_seq <= ctx.send_last_seq && ctx.send_offset >= ctx.send_sector_end)
+        {
+            ctx.send_seq++;
+            if (ctx.send_seq <= ctx.send_last_seq)
+            {
+                start_send_sector();
+            }
+        }
+        if (ctx.send_seq > ctx.send_last_seq)
+        {
+            static const uint8_t END = 0;
+            gattcomm_log_tx(&END, 1);
+            ctx.transferred_seq = ctx.send_last_seq;
+            finish_send();
+            ESP_LOGI(TAG, "Sent %"PRIu32" bytes at %"PRIu32" B/s", ctx.sent_bytes, ctx.send_rate);
+            break;
+        }
+
+        uint32_t length = gattcomm_get_tx_size();
+        if (length > sizeof(ctx.send_buffer))
+        {
+            length = sizeof(ctx.send_buffer);
+        }
+        if (length > ctx.send_sector_end - ctx.send_offset)
+        {
+            length = ctx.send_sector_end - ctx.send_offset;
+        }
+        uint32_t offset = sector_of(ctx.send_seq) * SECTOR_SIZE + ctx.send_offset;
+        esp_err_t err = esp_partition_read(ctx.partition, offset, ctx.send_buffer, length);
+        if (err || !gattcomm_log_tx(ctx.send_buffer, length))
+        {
+            ESP_LOGW(TAG, "Transfer aborted after %"PRIu32" bytes", ctx.sent_bytes);
+            finish_send();
+            break;
+        }
+        ctx.send_offset += length;
+        ctx.sent_bytes += length;
+    }
+    unlock();
+}
+
+void datalog_init(void)
+{
+    ctx.lock = xSemaphoreCreateMutexStatic(&ctx.lock_buffer);
+    if (ctx.lock == NULL)
+    {
+        ESP_LOGE(TAG, "xSemaphoreCreateMutexStatic failed");
+        panic(PANIC_ID_DATALOG_CREATE_MUTEX_FAILED);
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = on_send_timer,
+        .name = "datalog_send",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &ctx.send_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(PANIC_ID_DATALOG_TIMER_CREATE_FAILED);
+    }
+
+    parse_pids(CONFIG_VLINK_DATALOG_PIDS);
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY,
+                                                                PARTITION_LABEL);
+    if (partition == NULL)
+    {
+        ESP_LOGW(TAG, "No %s partition, logging disabled", PARTITION_LABEL);
+        return;
+    }
+
+    lock();
+    ctx.sector_count = partition->size / SECTOR_SIZE;
+    ctx.partition = partition;
+    ctx.sent_seq = nvsstore_load_u32(NVS_NAMESPACE, NVS_KEY_SENT);
+    ctx.session = nvsstore_load_u32(NVS_NAMESPACE, NVS_KEY_SESSION);
+    scan_partition();
+    ESP_LOGI(TAG, "Head sector %"PRIu32" seq %"PRIu32", %"PRIu32" unsent",
+             ctx.head_sector,
+             ctx.head_seq,
+             ctx.head_seq - ctx.sent_seq);
+    unlock();
+}
+
+bool datalog_is_available(void)
+{
+    return ctx.partition != NULL && ctx.pid_count > 0;
+}
+
+void datalog_start_session(const uint8_t *adapter_addr)
+{
+    lock();
+    if (ctx.sending)
+    {
+        finish_send();
+    }
+    ctx.in_session = true;
+    ctx.polling = false;
+    ctx.step = 0;
+    ctx.line_len = 0;
+    ctx.line_overflow = false;
+    ctx.session_start = esp_timer_get_time();
+    ctx.flush_time = ctx.session_start;
+    // A later LOG CLEAR must not drop what this session adds
+    ctx.transferred_seq = 0;
+    nvsstore_save_u32(NVS_NAMESPACE, NVS_KEY_SESSION, ++ctx.session);
+
+    uint8_t record[2 + 4 + 6];
+    record[0] = sizeof(record) - 1;
+    record[1] = RECORD_SESSION;
+    put_u32(record + 2, ctx.session);
+    memcpy(record + 6, adapter_addr, 6);
+    append_record(record, sizeof(record));
+    ESP_LOGI(TAG, "Session %"PRIu32" started", ctx.session);
+    unlock();
+}
+
+void datalog_end_session(void)
+{
+    lock();
+    if (ctx.in_session)
+    {
+        write_page();
+        ctx.in_session = false;
+        ctx.polling = false;
+        ESP_LOGI(TAG, "Session %"PRIu32" ended, %"PRIu32" records", ctx.session, ctx.records);
+    }
+    unlock();
+}
+
+const char *datalog_next_cmd(void)
+{
+    // Defaults, then echo, spaces and headers off for short replies
+    static const char *const SETUP_CMDS[] = { "ATD\r", "ATE0\r", "ATS0\r", "ATH0\r" };
+    const int setup_count = sizeof(SETUP_CMDS) / sizeof(SETUP_CMDS[0]);
+
+    const char *cmd = NULL;
+    lock();
+    ctx.line_len = 0;
+    ctx.line_overflow = false;
+    int step = ctx.step++;
+    if (step < setup_count)
+    {
+        ctx.polling = false;
+        cmd = SETUP_CMDS[step];
+    }
+    else if (step - setup_count < ctx.pid_count)
+    {
+        ctx.polling = true;
+        cmd = ctx.pids[step - setup_count];
+    }
+    else
+    {
+        ctx.polling = false;
+        ctx.step = setup_count;
+        if (esp_timer_get_time() - ctx.flush_time >= CONFIG_VLINK_DATALOG_FLUSH_S * 1000000LL)
+        {
+            write_page();
+        }
+    }
+    unlock();
+    return cmd;
+}
+
+void datalog_on_rx(const uint8_t *data, uint16_t length)
+{
+    lock();
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        switch (c)
+        {
+        case '\r':
+        case '\n':
+        case '>':
+            finish_line();
+            break;
+        case ' ':
+            break;
+        default:
+            if (ctx.line_len == sizeof(ctx.line))
+            {
+                ctx.line_overflow = true;
+                break;
+            }
+            ctx.line[ctx.line_len++] = c;
+            break;
+        }
+    }
+    unlock();
+}
+
+bool datalog_send(void)
+{
+    lock();
+    bool ok = ctx.partition != NULL && !ctx.sending && !ctx.in_session;
+    if (ok)
+    {
+        ctx.send_seq = backlog_seq();
+        ctx.send_last_seq = ctx.head_seq;
+        ctx.send_offset = HEADER_LEN;
+        ctx.send_sector_end = HEADER_LEN;
+        if (ctx.send_seq <= ctx.send_last_seq)
+        {
+            start_send_sector();
+        }
+        ctx.send_start = esp_timer_get_time();
+        ctx.sent_bytes = 0;
+        ctx.sending = true;
+        ESP_LOGI(TAG, "Sending sectors %"PRIu32" to %"PRIu32, ctx.send_seq, ctx.send_last_seq);
+        esp_timer_start_periodic(ctx.send_timer, SEND_INTERVAL_MS * 1000);
+    }
+    unlock();
+    return ok;
+}
+
+bool datalog_clear(void)
+{
+    lock();
+    bool ok = ctx.partition != NULL && !ctx.sending;
+    if (ok && ctx.transferred_seq > ctx.sent_seq)
+    {
+        ctx.sent_seq = ctx.transferred_seq;
+        nvsstore_save_u32(NVS_NAMESPACE, NVS_KEY_SENT, ctx.sent_seq);
+        if (ctx.sent_seq == ctx.head_seq)
+        {
+            // New records go to a fresh sector
+            ctx.head_used = SECTOR_SIZE;
+        }
+        ESP_LOGI(TAG, "Cleared up to sector %"PRIu32, ctx.sent_seq);
+    }
+    unlock();
+    return ok;
+}
+
+void datalog_write_stats(stats_writer_t *writer)
+{
+    uint32_t unsent = ctx.head_seq - backlog_seq() + 1;
+    stats_printf(writer, "datalog=unsent:%"PRIu32"/%"PRIu32" records:%"PRIu32" miss:%"PRIu32" erases:%"PRIu32" lost:%"PRIu32" sent:%"PRIu32"B/s\n",
+                 ctx.partition != NULL ? unsent : 0,
+                 ctx.sector_count,
+                 ctx.records,
+                 ctx.misses,
+                 ctx.erases,
+                 ctx.lost_sectors,
+                 ctx.send_rate);
+}
+
+#endif
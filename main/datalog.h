@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
+
+void datalog_init(void);
+// False without the log partition
+bool datalog_is_available(void);
+
+void datalog_start_session(const uint8_t *adapter_addr);
+void datalog_end_session(void);
+// Setup commands, then one PID request per call. Returns NULL at the end
+// of a poll cycle, the next call starts the next cycle.
+const char *datalog_next_cmd(void);
+void datalog_on_rx(const uint8_t *data, uint16_t length);
+
+// Streams the backlog over the log characteristic, a zero byte where the
+// next record length would be ends it
+bool datalog_send(void);
+// Drops what the last transfer sent
+bool datalog_clear(void);
+void datalog_write_stats(stats_writer_t *writer);
@@ -0,0 +1,251 @@
+#include "elmcfg.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <esp_log.h>
+
+#define TAG         "ELMCFG"
+#define MAX_ENTRIES 24
+
+typedef enum
+{
+    ARG_NONE,
+    // 0 or 1
+    ARG_BOOL,
+    // 0, 1 or 2
+    ARG_DIGIT,
+    // One or more hex digits
+    ARG_HEX,
+    // Zero or more hex digits
+    ARG_HEX_OPT,
+} arg_type_t;
+
+typedef struct
+{
+    const char *name;
+    arg_type_t arg;
+} setting_t;
+
+// AT commands that change adapter state a client relies on. Longer names
+// come before shorter names sharing a prefix.
+static const setting_t SETTINGS[] = {
+    { "CAF", ARG_BOOL },
+    { "CFC", ARG_BOOL },
+    { "CRA", ARG_HEX_OPT },
+    { "CEA", ARG_HEX_OPT },
+    { "CF",  ARG_HEX },
+    { "CM",  ARG_HEX },
+    { "SH",  ARG_HEX },
+    { "SP",  ARG_HEX },
+    { "TP",  ARG_HEX },
+    { "ST",  ARG_HEX },
+    { "SW",  ARG_HEX },
+    { "IB",  ARG_HEX },
+    { "KW",  ARG_BOOL },
+    { "AT",  ARG_DIGIT },
+    { "AL",  ARG_NONE },
+    { "NL",  ARG_NONE },
+    { "D",   ARG_BOOL },
+    { "E",   ARG_BOOL },
+    { "H",   ARG_BOOL },
+    { "L",   ARG_BOOL },
+    { "R",   ARG_BOOL },
+    { "S",   ARG_BOOL },
+};
+
+// Commands that put the adapter back to its defaults
+static const char *const RESETS[] = { "Z", "WS", "D" };
+
+typedef struct
+{
+    const setting_t *setting;
+    char cmd[ELMCFG_CMD_MAX_LEN];
+} entry_t;
+
+static struct
+{
+    entry_t entries[MAX_ENTRIES];
+    int count;
+} ctx;
+
+static bool is_arg_valid(arg_type_t type, const char *arg)
+{
+    size_t len = strlen(arg);
+    switch (type)
+    {
+    case ARG_NONE:
+        return len == 0;
+    case ARG_BOOL:
+        return len == 1 && (arg[0] == '0' || arg[0] == '1');
+    case ARG_DIGIT:
+        return len == 1 && arg[0] >= '0' && arg[0] <= '2';
+    case ARG_HEX:
+    case ARG_HEX_OPT:
+        if (len == 0 && type == ARG_HEX)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            if (!isxdigit((unsigned char)arg[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static const setting_t *find_setting(const char *name)
+{
+    for (size_t i = 0; i < sizeof(SETTINGS) / sizeof(SETTINGS[0]); i++)
+    {
+        size_t len = strlen(SETTINGS[i].name);
+        if (strncmp(name, SETTINGS[i].name, len) == 0
+            && is_arg_valid(SETTINGS[i].arg, name + len))
+        {
+            return &SETTINGS[i];
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(int index)
+{
+    memmove(&ctx.entries[index],
+            &ctx.entries[index + 1],
+            (ctx.count - index - 1) * sizeof(entry_t));
+    ctx.count--;
+}
+
+void elmcfg_reset(void)
+{
+    ctx.count = 0;
+}
+
+int elmcfg_normalize(const char *cmd, uint16_t length, char *norm, int size)
+{
+    // ELM327 commands are case insensitive and ignore spaces
+    int norm_len = 0;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        if (cmd[i] <= ' ')
+        {
+            continue;
+        }
+        if (norm_len == size - 1)
+        {
+            return -1;
+        }
+        norm[norm_len++] = toupper((unsigned char)cmd[i]);
+    }
+    norm[norm_len] = 0;
+    return norm_len;
+}
+
+int elmcfg_hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+int elmcfg_parse_cmd_list(const char *list, uint16_t length, char *cmds, int cmd_size, int max_cmds)
+{
+    int count = 0;
+    int cmd_len = 0;
+    for (uint16_t i = 0; i <= length; i++)
+    {
+        char c = i < length ? list[i] : ',';
+        if (c == ' ')
+        {
+            continue;
+        }
+        char *cmd = cmds + count * cmd_size;
+        if (c != ',')
+        {
+            if (cmd_len == cmd_size - 2 || count == max_cmds)
+            {
+                return -1;
+            }
+            cmd[cmd_len++] = c;
+            continue;
+        }
+        if (cmd_len > 0)
+        {
+            strcpy(&cmd[cmd_len], "\r");
+            count++;
+            cmd_len = 0;
+        }
+    }
+    return count;
+}
+
+void elmcfg_record(const char *cmd, uint16_t length)
+{
+    char norm[ELMCFG_CMD_MAX_LEN];
+    int norm_len = elmcfg_normalize(cmd, length, norm, sizeof(norm));
+    if (norm_len < 3 || norm[0] != 'A' || norm[1] != 'T')
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(RESETS) / sizeof(RESETS[0]); i++)
+    {
+        if (strcmp(norm + 2, RESETS[i]) == 0)
+        {
+            elmcfg_reset();
+            return;
+        }
+    }
+
+    const setting_t *setting = find_setting(norm + 2);
+    if (setting == NULL)
+    {
+        return;
+    }
+
+    // Keep entries in the order they were last set so that replaying them
+    // reproduces interactions such as ATCRA clearing ATCF/ATCM
+    for (int i = 0; i < ctx.count; i++)
+    {
+        if (ctx.entries[i].setting == setting)
+        {
+            remove_entry(i);
+            break;
+        }
+    }
+
+    if (ctx.count == MAX_ENTRIES)
+    {
+        ESP_LOGW(TAG, "Too many settings, dropping %s", ctx.entries[0].cmd);
+        remove_entry(0);
+    }
+
+    entry_t *entry = &ctx.entries[ctx.count++];
+    entry->setting = setting;
+    strcpy(entry->cmd, norm);
+}
+
+int elmcfg_count(void)
+{
+    return ctx.count;
+}
+
+const char *elmcfg_get(int index)
+{
+    return ctx.entries[index].cmd;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+#define ELMCFG_CMD_MAX_LEN 32
+
+int elmcfg_normalize(const char *cmd, uint16_t length, char *norm, int size);
+// -1 for anything but a hex digit
+int elmcfg_hex_value(char c);
+// Splits "010C,010D" into commands ending in "\r", blanks are ignored.
+// cmds holds max_cmds of cmd_size bytes each. Returns the number of
+// commands, -1 when one is too long or there are too many.
+int elmcfg_parse_cmd_list(const char *list, uint16_t length, char *cmds, int cmd_size, int max_cmds);
+void elmcfg_reset(void);
+void elmcfg_record(const char *cmd, uint16_t length);
+int elmcfg_count(void);
+const char *elmcfg_get(int index);
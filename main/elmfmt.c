@@ -0,0 +1,377 @@
+#include "elmfmt.h"
+#include "elmcfg.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+
+#define TAG "ELMFMT"
+
+// Longest reassembled ISO-TP line: header, PCI and 256 payload bytes
+#define LINE_MAX_LEN      528
+#define OUT_BUFFER_LEN    256
+// Most adapters start with linefeeds off
+#define LINEFEEDS_DEFAULT false
+
+typedef struct
+{
+    bool echo;
+    bool spaces;
+    bool linefeeds;
+} format_t;
+
+static struct
+{
+    // What the client asked for and what the adapter is set to
+    format_t client;
+    format_t adapter;
+    bool headers;
+    // The last command was an OBD request, AT replies are never spaced
+    bool obd_request;
+    // The command about to reach the adapter came through
+    // elmfmt_on_client_line(), the client settings are already recorded
+    bool client_line_seen;
+
+    // Adapter output line being rebuilt
+    char line[LINE_MAX_LEN];
+    uint16_t line_len;
+    // Too long to be OBD data, passed on as is
+    bool line_raw;
+
+    uint8_t out[OUT_BUFFER_LEN];
+    uint16_t out_len;
+
+    uint32_t adapter_bytes;
+    uint32_t client_bytes;
+    uint32_t setups;
+} ctx;
+
+static void set_defaults(format_t *format)
+{
+    format->echo = true;
+    format->spaces = true;
+    format->linefeeds = LINEFEEDS_DEFAULT;
+}
+
+static bool is_compact(void)
+{
+    return !ctx.adapter.echo && !ctx.adapter.spaces && !ctx.adapter.linefeeds;
+}
+
+static bool is_hex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F');
+}
+
+static bool is_reset(const char *norm)
+{
+    return strcmp(norm, "ATZ") == 0 || strcmp(norm, "ATD") == 0 || strcmp(norm, "ATWS") == 0;
+}
+
+// Returns true for ATE, ATS and ATL, resets are applied as well
+static bool apply_command(const char *norm, format_t *format)
+{
+    if (norm[0] != 'A' || norm[1] != 'T')
+    {
+        return false;
+    }
+
+    const char *cmd = norm + 2;
+    if (is_reset(norm))
+    {
+        set_defaults(format);
+        return false;
+    }
+    if ((cmd[1] != '0' && cmd[1] != '1') || cmd[2] != '\0')
+    {
+        return false;
+    }
+
+    bool on = cmd[1] == '1';
+    switch (cmd[0])
+    {
+    case 'E':
+        format->echo = on;
+        return true;
+    case 'S':
+        format->spaces = on;
+        return true;
+    case 'L':
+        format->linefeeds = on;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void out_flush(elmfmt_emit_t emit)
+{
+    if (ctx.out_len > 0)
+    {
+        emit(ctx.out, ctx.out_len);
+        ctx.client_bytes += ctx.out_len;
+        ctx.out_len = 0;
+    }
+}
+
+static void out_append(const char *data, uint16_t length, elmfmt_emit_t emit)
+{
+    while (length > 0)
+    {
+        if (ctx.out_len == sizeof(ctx.out))
+        {
+            out_flush(emit);
+        }
+        uint16_t chunk = sizeof(ctx.out) - ctx.out_len;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(ctx.out + ctx.out_len, data, chunk);
+        ctx.out_len += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+static void out_line_end(elmfmt_emit_t emit)
+{
+    out_append("\r\n", ctx.client.linefeeds ? 2 : 1, emit);
+}
+
+// Puts the spaces back into "410C1AF8", "7E803410C1AF8" and "0:490201"
+static bool expand_line(elmfmt_emit_t emit)
+{
+    const char *line = ctx.line;
+    int length = ctx.line_len;
+    int prefix = 0;
+    if (length > 2 && line[1] == ':' && is_hex(line[0]))
+    {
+        prefix = 2;
+    }
+    for (int i = prefix; i < length; i++)
+    {
+        if (!is_hex(line[i]))
+        {
+            return false;
+        }
+    }
+
+    // An odd digit count is an 11-bit CAN header, or the length line in
+    // front of a multi-frame reply which has no spaces
+    int header = 0;
+    if ((length - prefix) % 2 != 0)
+    {
+        if (!ctx.headers || prefix > 0 || length <= 3)
+        {
+            return false;
+        }
+        header = 3;
+    }
+
+    if (prefix > 0)
+    {
+        out_append(line, prefix, emit);
+        out_append(" ", 1, emit);
+    }
+    if (header > 0)
+    {
+        out_append(line, header, emit);
+        out_append(" ", 1, emit);
+    }
+    for (int i = prefix + header; i < length; i += 2)
+    {
+        out_append(line + i, 2, emit);
+        out_append(" ", 1, emit);
+    }
+    return true;
+}
+
+static void finish_line(elmfmt_emit_t emit)
+{
+    if (ctx.line_len > 0)
+    {
+        bool spaced = !ctx.line_raw && ctx.client.spaces && ctx.obd_request && expand_line(emit);
+        if (!spaced)
+        {
+            out_append(ctx.line, ctx.line_len, emit);
+        }
+    }
+    ctx.line_len = 0;
+    ctx.line_raw = false;
+}
+
+void elmfmt_start(void)
+{
+    set_defaults(&ctx.client);
+    ctx.headers = false;
+    ctx.obd_request = false;
+    ctx.client_line_seen = false;
+    elmfmt_on_adapter_reset();
+}
+
+void elmfmt_on_adapter_reset(void)
+{
+    // Unknown, set again before the next client command
+    set_defaults(&ctx.adapter);
+    ctx.adapter.linefeeds = true;
+    ctx.line_len = 0;
+    ctx.line_raw = false;
+}
+
+const char *elmfmt_before_request(void)
+{
+    // Assumed to take effect, the replies are not forwarded
+    if (ctx.adapter.echo)
+    {
+        ctx.adapter.echo = false;
+        ctx.setups++;
+        return "ATE0\r";
+    }
+    if (ctx.adapter.spaces)
+    {
+        ctx.adapter.spaces = false;
+        return "ATS0\r";
+    }
+    if (ctx.adapter.linefeeds)
+    {
+        ctx.adapter.linefeeds = false;
+        return "ATL0\r";
+    }
+    return NULL;
+}
+
+void elmfmt_echo(const char *line, uint16_t length, elmfmt_emit_t emit)
+{
+    if (ctx.client.echo)
+    {
+        out_append(line, length, emit);
+        out_line_end(emit);
+        out_flush(emit);
+    }
+}
+
+void elmfmt_on_client_line(char *line, uint16_t length, elmfmt_emit_t emit)
+{
+    ctx.client_line_seen = true;
+    elmfmt_echo(line, length, emit);
+
+    char norm[ELMCFG_CMD_MAX_LEN];
+    if (elmcfg_normalize(line, length, norm, sizeof(norm)) < 2)
+    {
+        return;
+    }
+    if (apply_command(norm, &ctx.client))
+    {
+        // The adapter gets the same command turning the setting off
+        for (int i = length - 1; i >= 0; i--)
+        {
+            if (line[i] > ' ')
+            {
+                line[i] = '0';
+                break;
+            }
+        }
+    }
+}
+
+void elmfmt_on_request(const char *line, uint16_t length)
+{
+    bool client_line_seen = ctx.client_line_seen;
+    ctx.client_line_seen = false;
+
+    char norm[ELMCFG_CMD_MAX_LEN];
+    int norm_len = elmcfg_normalize(line, length, norm, sizeof(norm));
+    if (norm_len == 0)
+    {
+        // An empty line repeats the last command
+        return;
+    }
+    ctx.obd_request = false;
+    if (norm_len < 2)
+    {
+        return;
+    }
+
+    if (norm[0] == 'A' && norm[1] == 'T')
+    {
+        if (is_reset(norm))
+        {
+            elmfmt_on_adapter_reset();
+        }
+        else
+        {
+            apply_command(norm, &ctx.adapter);
+        }
+        if (!client_line_seen)
+        {
+            apply_command(norm, &ctx.client);
+        }
+        if (strcmp(norm + 2, "H1") == 0)
+        {
+            ctx.headers = true;
+        }
+        else if (strcmp(norm + 2, "H0") == 0 || is_reset(norm))
+        {
+            ctx.headers = false;
+        }
+        return;
+    }
+
+    ctx.obd_request = true;
+    for (int i = 0; i < norm_len; i++)
+    {
+        ctx.obd_request = ctx.obd_request && is_hex(norm[i]);
+    }
+}
+
+void elmfmt_format(const uint8_t *data, uint16_t length, elmfmt_emit_t emit)
+{
+    ctx.adapter_bytes += length;
+    if (!is_compact())
+    {
+        // The adapter formats its output for the client itself
+        emit(data, length);
+        ctx.client_bytes += length;
+        return;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        switch (c)
+        {
+        case '\r':
+            finish_line(emit);
+            out_line_end(emit);
+            break;
+        case '\n':
+            break;
+        case '>':
+            finish_line(emit);
+            out_append(">", 1, emit);
+            break;
+        default:
+            if (ctx.line_len == sizeof(ctx.line))
+            {
+                out_append(ctx.line, ctx.line_len, emit);
+                ctx.line_len = 0;
+                ctx.line_raw = true;
+            }
+            ctx.line[ctx.line_len++] = c;
+            break;
+        }
+    }
+    out_flush(emit);
+}
+
+void elmfmt_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "elmfmt=spp:%"PRIu32" gatt:%"PRIu32" setup:%"PRIu32"%s\n",
+                 ctx.adapter_bytes,
+                 ctx.client_bytes,
+                 ctx.setups,
+                 is_compact() ? "" : " raw");
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include "stats.h"
+
+typedef void (*elmfmt_emit_t)(const uint8_t *data, uint16_t length);
+
+void elmfmt_start(void);
+void elmfmt_on_adapter_reset(void);
+const char *elmfmt_before_request(void);
+// The echo the client asked for, the adapter's is off
+void elmfmt_echo(const char *line, uint16_t length, elmfmt_emit_t emit);
+void elmfmt_on_client_line(char *line, uint16_t length, elmfmt_emit_t emit);
+void elmfmt_on_request(const char *line, uint16_t length);
+void elmfmt_format(const uint8_t *data, uint16_t length, elmfmt_emit_t emit);
+void elmfmt_write_stats(stats_writer_t *writer);
@@ -0,0 +1,401 @@
+#include "elmtiming.h"
+#include "elmcfg.h"
+#include "nvsstore.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG           "ELMTIMING"
+#define NVS_NAMESPACE "elmtiming"
+
+// ATST counts in 4 ms units, the ELM327 default is 0x32 (200 ms)
+#define ST_UNIT_US    4000
+#define DEFAULT_ST    0x32
+#define MIN_ST        5
+// One bucket per ATST unit, the last one collects everything slower
+#define BUCKETS       (DEFAULT_ST + 1)
+#define MAX_CLASSES   12
+#define MIN_SAMPLES   32
+// Halved beyond this so that recent behaviour dominates
+#define MAX_SAMPLES   1024
+#define MAX_BACKOFF   3
+// The timeout is only tightened once the last few requests all allow it,
+// so that alternating request classes do not cost an ATST each
+#define RECENT_COUNT  8
+
+typedef struct
+{
+    // ATSP/ATTP protocol digit, '0' for automatic
+    char protocol;
+    // OBD mode, the first request byte
+    uint8_t mode;
+    // Raised on NO DATA with a tightened timeout, widens the margin
+    uint8_t backoff;
+    uint16_t samples;
+    uint16_t buckets[BUCKETS];
+} timing_class_t;
+
+typedef struct
+{
+    uint8_t count;
+    timing_class_t classes[MAX_CLASSES];
+} saved_classes_t;
+
+static struct
+{
+    bool active;
+    bool dirty;
+    // The client sets its own timeout, stay out of it
+    bool client_override;
+    uint8_t adapter_addr[6];
+    char protocol;
+    uint8_t applied_st;
+    uint8_t recent_st[RECENT_COUNT];
+    int recent_index;
+    char inject_cmd[12];
+
+    // Request in flight, NULL when not sampled
+    timing_class_t *request_class;
+    int64_t last_event_time;
+    int64_t max_gap_us;
+    bool got_data;
+    bool no_data;
+    bool skip_sample;
+
+    uint32_t injections;
+    uint32_t backoffs;
+    saved_classes_t saved;
+} ctx;
+
+static void load_classes(void)
+{
+    char key[NVSSTORE_ADDR_KEY_LEN];
+    nvsstore_make_addr_key(ctx.adapter_addr, key);
+    if (!nvsstore_load_blob(NVS_NAMESPACE, key, &ctx.saved, sizeof(ctx.saved)) || ctx.saved.count > MAX_CLASSES)
+    {
+        ctx.saved.count = 0;
+        return;
+    }
+    ESP_LOGI(TAG, "Loaded %d request classes for %s", ctx.saved.count, key);
+}
+
+static void save_classes(void)
+{
+    char key[NVSSTORE_ADDR_KEY_LEN];
+    nvsstore_make_addr_key(ctx.adapter_addr, key);
+    nvsstore_save_blob(NVS_NAMESPACE, key, &ctx.saved, sizeof(ctx.saved));
+}
+
+// Returns true for an OBD request, AT commands are handled here as well
+static bool parse_request(const char *line, uint16_t length, uint8_t *mode)
+{
+    char norm[ELMCFG_CMD_MAX_LEN];
+    int norm_len = elmcfg_normalize(line, length, norm, sizeof(norm));
+    if (norm_len < 2)
+    {
+        return false;
+    }
+
+    if (norm[0] == 'A' && norm[1] == 'T')
+    {
+        if (strncmp(norm + 2, "ST", 2) == 0 || strncmp(norm + 2, "AT", 2) == 0)
+        {
+            if (!ctx.client_override)
+            {
+                ESP_LOGI(TAG, "Client sets %s, adaptive timeout off", norm);
+            }
+            ctx.client_override = true;
+        }
+        else if (strncmp(norm + 2, "SP", 2) == 0 || strncmp(norm + 2, "TP", 2) == 0)
+        {
+            ctx.protocol = norm[norm_len - 1];
+        }
+        else if (strcmp(norm + 2, "Z") == 0 || strcmp(norm + 2, "D") == 0 || strcmp(norm + 2, "WS") == 0)
+        {
+            elmtiming_on_adapter_reset();
+        }
+        return false;
+    }
+
+    for (int i = 0; i < norm_len; i++)
+    {
+        if (elmcfg_hex_value(norm[i]) < 0)
+        {
+            return false;
+        }
+    }
+    *mode = elmcfg_hex_value(norm[0]) << 4 | elmcfg_hex_value(norm[1]);
+    return true;
+}
+
+static timing_class_t *find_class(uint8_t mode, bool create)
+{
+    for (int i = 0; i < ctx.saved.count; i++)
+    {
+        timing_class_t *timing_class = &ctx.saved.classes[i];
+        if (timing_class->protocol == ctx.protocol && timing_class->mode == mode)
+        {
+            return timing_class;
+        }
+    }
+
+    if (!create || ctx.saved.count == MAX_CLASSES)
+    {
+        return NULL;
+    }
+
+    timing_class_t *timing_class = &ctx.saved.classes[ctx.saved.count++];
+    memset(timing_class, 0, sizeof(*timing_class));
+    timing_class->protocol = ctx.protocol;
+    timing_class->mode = mode;
+    return timing_class;
+}
+
+static uint8_t p99_units(const timing_class_t *timing_class)
+{
+    uint32_t threshold = (timing_class->samples * 99 + 99) / 100;
+    uint32_t cumulative = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        cumulative += timing_class->buckets[i];
+        if (cumulative >= threshold)
+        {
+            return i + 1;
+        }
+    }
+    return DEFAULT_ST;
+}
+
+static uint8_t desired_st(const timing_class_t *timing_class)
+{
+    if (timing_class == NULL || timing_class->samples < MIN_SAMPLES)
+    {
+        return DEFAULT_ST;
+    }
+
+    // 1.5x the p99 plus 8 ms, widened by each backoff
+    uint32_t st = p99_units(timing_class) * (3 + 2 * timing_class->backoff) / 2 + 2;
+    if (st < MIN_ST)
+    {
+        st = MIN_ST;
+    }
+    return st > DEFAULT_ST ? DEFAULT_ST : st;
+}
+
+static void add_sample(timing_class_t *timing_class, int64_t gap_us)
+{
+    int bucket = gap_us / ST_UNIT_US;
+    if (bucket >= BUCKETS)
+    {
+        bucket = BUCKETS - 1;
+    }
+    timing_class->buckets[bucket]++;
+    timing_class->samples++;
+
+    if (timing_class->samples > MAX_SAMPLES)
+    {
+        timing_class->samples = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            timing_class->buckets[i] /= 2;
+            timing_class->samples += timing_class->buckets[i];
+        }
+    }
+    ctx.dirty = true;
+}
+
+static void finish_request(void)
+{
+    timing_class_t *timing_class = ctx.request_class;
+    ctx.request_class = NULL;
+
+    if (ctx.no_data)
+    {
+        // Possibly cut off by a timeout that was too tight
+        if (ctx.applied_st < DEFAULT_ST && timing_class->backoff < MAX_BACKOFF)
+        {
+            timing_class->backoff++;
+            ctx.backoffs++;
+            ctx.dirty = true;
+            ESP_LOGW(TAG, "NO DATA with ATST%02X, mode %02X backoff %d",
+                     ctx.applied_st,
+                     timing_class->mode,
+                     timing_class->backoff);
+        }
+        return;
+    }
+
+    if (ctx.got_data && !ctx.skip_sample)
+    {
+        add_sample(timing_class, ctx.max_gap_us);
+    }
+}
+
+void elmtiming_start(const uint8_t *adapter_addr)
+{
+    // A client resuming a lingering session keeps the learned state
+    if (ctx.active && memcmp(ctx.adapter_addr, adapter_addr, sizeof(ctx.adapter_addr)) == 0)
+    {
+        return;
+    }
+
+    elmtiming_stop();
+    memcpy(ctx.adapter_addr, adapter_addr, sizeof(ctx.adapter_addr));
+    load_classes();
+    ctx.active = true;
+    ctx.client_override = false;
+    ctx.protocol = '0';
+    elmtiming_on_adapter_reset();
+}
+
+void elmtiming_stop(void)
+{
+    if (ctx.active && ctx.dirty)
+    {
+        save_classes();
+    }
+    ctx.active = false;
+    ctx.dirty = false;
+    ctx.request_class = NULL;
+}
+
+void elmtiming_on_adapter_reset(void)
+{
+    ctx.applied_st = DEFAULT_ST;
+    memset(ctx.recent_st, DEFAULT_ST, sizeof(ctx.recent_st));
+}
+
+const char *elmtiming_before_request(const char *line, uint16_t length)
+{
+    uint8_t mode;
+    if (!ctx.active || ctx.client_override || !parse_request(line, length, &mode))
+    {
+        return NULL;
+    }
+
+    ctx.recent_st[ctx.recent_index] = desired_st(find_class(mode, false));
+    ctx.recent_index = (ctx.recent_index + 1) % RECENT_COUNT;
+
+    uint8_t target = 0;
+    for (int i = 0; i < RECENT_COUNT; i++)
+    {
+        if (ctx.recent_st[i] > target)
+        {
+            target = ctx.recent_st[i];
+        }
+    }
+
+    // Loosened at once, tightened only by more than one unit
+    if (target > ctx.applied_st || target + 1 < ctx.applied_st)
+    {
+        ESP_LOGI(TAG, "Response timeout %d -> %d ms", ctx.applied_st * 4, target * 4);
+        ctx.applied_st = target;
+        ctx.injections++;
+        sprintf(ctx.inject_cmd, "ATST%02X\r", target);
+        return ctx.inject_cmd;
+    }
+    return NULL;
+}
+
+void elmtiming_on_request(const char *line, uint16_t length)
+{
+    uint8_t mode;
+    ctx.request_class = NULL;
+    if (!ctx.active || !parse_request(line, length, &mode))
+    {
+        return;
+    }
+
+    ctx.request_class = find_class(mode, true);
+    ctx.last_event_time = esp_timer_get_time();
+    ctx.max_gap_us = 0;
+    ctx.got_data = false;
+    ctx.no_data = false;
+    ctx.skip_sample = false;
+}
+
+static bool contains(const uint8_t *data, uint16_t length, const char *text)
+{
+    size_t text_len = strlen(text);
+    for (uint16_t i = 0; i + text_len <= length; i++)
+    {
+        if (memcmp(data + i, text, text_len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void elmtiming_on_rx(const uint8_t *data, uint16_t length)
+{
+    if (ctx.request_class == NULL)
+    {
+        return;
+    }
+
+    // The adapter waits out its timeout after the last reply before the
+    // prompt, only gaps before chunks with content count
+    bool has_content = false;
+    bool has_prompt = false;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        switch (data[i])
+        {
+        case '\r':
+        case '\n':
+        case ' ':
+            break;
+        case '>':
+            has_prompt = true;
+            break;
+        default:
+            has_content = true;
+            break;
+        }
+    }
+
+    if (has_content)
+    {
+        int64_t now = esp_timer_get_time();
+        if (now - ctx.last_event_time > ctx.max_gap_us)
+        {
+            ctx.max_gap_us = now - ctx.last_event_time;
+        }
+        ctx.last_event_time = now;
+        ctx.got_data = true;
+
+        if (contains(data, length, "NO DATA"))
+        {
+            ctx.no_data = true;
+        }
+        // Protocol search and errors say nothing about the ECU
+        if (contains(data, length, "SEARCHING")
+            || contains(data, length, "BUS INIT")
+            || contains(data, length, "STOPPED")
+            || memchr(data, '?', length) != NULL)
+        {
+            ctx.skip_sample = true;
+        }
+    }
+
+    if (has_prompt)
+    {
+        finish_request();
+    }
+}
+
+void elmtiming_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "elmtiming=st:%02X classes:%d inject:%"PRIu32" backoff:%"PRIu32"%s\n",
+                 ctx.applied_st,
+                 ctx.saved.count,
+                 ctx.injections,
+                 ctx.backoffs,
+                 ctx.client_override ? " client" : "");
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#include "stats.h"
+
+void elmtiming_start(const uint8_t *adapter_addr);
+void elmtiming_stop(void);
+void elmtiming_on_adapter_reset(void);
+const char *elmtiming_before_request(const char *line, uint16_t length);
+void elmtiming_on_request(const char *line, uint16_t length);
+void elmtiming_on_rx(const uint8_t *data, uint16_t length);
+void elmtiming_write_stats(stats_writer_t *writer);
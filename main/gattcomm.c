@@ -1,12 +1,19 @@
 #include "gattcomm.h"
 #include "app.h"
+#include "bootprof.h"
+#include "stats.h"
+#include "coex.h"
+#include "lzss.h"
+#include "nvsstore.h"
 
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_gap_ble_api.h>
 #include <esp_gatts_api.h>
 #include <esp_gatt_common_api.h>
@@ -14,6 +21,39 @@
 #define TAG                "GATTCOMM"
 #define SERVICE_UUID_BYTES 0xe7, 0x81, 0x0a, 0x71, 0x73, 0xae, 0x49, 0x9d, 0x8c, 0x15, 0xfa, 0xa9, 0xae, 0xf0, 0xc3, 0xf2
 #define CHAR_UUID_BYTES    0xbe, 0xf8, 0xd6, 0xc9, 0x9c, 0x21, 0x4c, 0x9e, 0xb6, 0x32, 0xbd, 0x58, 0xc1, 0x00, 0x9f, 0x9f
+#define STATS_UUID_BYTES   0x3a, 0x5d, 0x21, 0x8e, 0x0c, 0x47, 0x4b, 0x6f, 0x9e, 0x03, 0x5b, 0xd2, 0x74, 0x1c, 0xa8, 0x6e
+#define CONTROL_UUID_BYTES 0x91, 0x2c, 0x6e, 0xd4, 0x58, 0x0b, 0x4e, 0x1a, 0xa7, 0x36, 0xc2, 0x4f, 0x0d, 0x83, 0xe9, 0x15
+#define LOG_UUID_BYTES     0x5e, 0x07, 0xb3, 0x42, 0x1d, 0x96, 0x4c, 0x2a, 0x8f, 0x61, 0x3e, 0xd0, 0x97, 0x4b, 0x25, 0xc8
+#define NVS_NAMESPACE      "gattcomm"
+#define NVS_KEY_LAST_PEER  "last_peer"
+#define DEFAULT_MTU        23
+// Longest attribute value allowed by the ATT protocol
+#define STATS_MAX_LEN      512
+// Compressed block: marker, original and compressed length (little
+// endian), then the LZSS data. Plain output never holds the marker.
+#define BLOCK_MARKER       0x01
+#define BLOCK_HEADER_LEN   5
+// Output that does not end in a prompt goes out after this much quiet
+#define COMPRESS_FLUSH_MS  20
+
+typedef struct
+{
+    esp_bd_addr_t addr;
+    uint8_t addr_type;
+} peer_t;
+
+typedef enum
+{
+    ADV_PHASE_NONE,
+    // High duty cycle directed advertising to the bonded client
+    ADV_PHASE_DIRECTED,
+    // Quick discovery after boot or disconnect
+    ADV_PHASE_FAST,
+    ADV_PHASE_SLOW,
+    // Long inactivity, minimise standby current
+    ADV_PHASE_IDLE,
+    ADV_PHASE_COUNT,
+} adv_phase_t;
 
 static struct
 {
@@ -24,12 +64,71 @@ static struct
     uint16_t service_handle;
     uint16_t char_handle;
     uint16_t cccd_handle;
+    uint16_t stats_char_handle;
+    uint16_t control_char_handle;
+    // Bulk transfer of the data log, notified apart from the bridge data
+    uint16_t log_char_handle;
+    uint16_t log_cccd_handle;
     uint16_t conn_id;
+    uint16_t mtu;
     bool notify_enabled;
+    bool log_notify_enabled;
+    // The controller's notification queue is full
+    bool congested;
+    uint32_t congestions;
+    // Notified bytes, and the most sent within one second
+    uint32_t notify_bytes;
+    uint32_t notify_count;
+    int64_t notify_window_start;
+    uint32_t notify_window_bytes;
+    uint32_t notify_peak;
+
+    // Taken at offset 0 so that a long read sees consistent values
+    char stats_snapshot[STATS_MAX_LEN];
+    uint16_t stats_snapshot_len;
+
+    // Last client that completed bonding, target of directed advertising
+    bool has_bonded_peer;
+    peer_t bonded_peer;
+
+    // Response to a data write withheld by the bridge as backpressure
+    bool write_rsp_pending;
+    uint16_t write_rsp_conn_id;
+    uint32_t write_rsp_trans_id;
+    uint32_t write_rsp_holds;
+
+    // Prepared writes to the data characteristic, handed to the bridge as
+    // one unit when executed
+    uint8_t prep_buffer[CONFIG_VLINK_PREP_WRITE_MAX_LEN];
+    uint16_t prep_len;
+    bool prep_overflow;
+    uint32_t prep_batches;
+
+#if CONFIG_VLINK_BLE_COMPRESSION
+    // Switched on by the client, compression state is per connection
+    bool compression;
+    // The bridge and the probe timer notify from different tasks
+    SemaphoreHandle_t tx_lock;
+    StaticSemaphore_t tx_lock_buffer;
+    uint8_t block[BLOCK_HEADER_LEN + LZSS_OUT_MAX(LZSS_UNIT_MAX)];
+    // SPP output collected up to the prompt so a reply is compressed as
+    // a whole rather than chunk by chunk
+    uint8_t pending[LZSS_UNIT_MAX];
+    uint16_t pending_len;
+    esp_timer_handle_t flush_timer;
+#endif
+
+    adv_phase_t adv_phase;
+    int64_t adv_phase_begin_time;
+    uint64_t adv_phase_time_us[ADV_PHASE_COUNT];
+    esp_timer_handle_t adv_timer;
 } ctx;
 
 #define CONN_ID_INVALID 0xFFFF
 
+// The bridge resumes from its own tasks
+static portMUX_TYPE write_rsp_mux = portMUX_INITIALIZER_UNLOCKED;
+
 static esp_gatt_srvc_id_t SERVICE_ID = {
     .is_primary = true,
     .id.inst_id = 0,
@@ -42,6 +141,21 @@ static esp_bt_uuid_t CHAR_UUID = {
     .uuid.uuid128 = { CHAR_UUID_BYTES }
 };
 
+static esp_bt_uuid_t STATS_UUID = {
+    .len = ESP_UUID_LEN_128,
+    .uuid.uuid128 = { STATS_UUID_BYTES }
+};
+
+static esp_bt_uuid_t CONTROL_UUID = {
+    .len = ESP_UUID_LEN_128,
+    .uuid.uuid128 = { CONTROL_UUID_BYTES }
+};
+
+static esp_bt_uuid_t LOG_UUID = {
+    .len = ESP_UUID_LEN_128,
+    .uuid.uuid128 = { LOG_UUID_BYTES }
+};
+
 static esp_bt_uuid_t CCCD_UUID = {
     .len = ESP_UUID_LEN_16,
     .uuid.uuid16 = ESP_GATT_UUID_CHAR_CLIENT_CONFIG,
@@ -88,9 +202,111 @@ static esp_ble_adv_params_t ADV_PARAMS = {
     .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
 };
 
-static void start_advertising(void)
+#define ADV_INTERVAL_UNITS(ms) ((ms) * 1000 / 625)
+
+static const char *const ADV_PHASE_NAMES[ADV_PHASE_COUNT] = {
+    [ADV_PHASE_NONE] = "none",
+    [ADV_PHASE_DIRECTED] = "directed",
+    [ADV_PHASE_FAST] = "fast",
+    [ADV_PHASE_SLOW] = "slow",
+    [ADV_PHASE_IDLE] = "idle",
+};
+
+static void set_adv_phase(adv_phase_t phase)
+{
+    int64_t now = esp_timer_get_time();
+    if (ctx.adv_phase != ADV_PHASE_NONE)
+    {
+        ctx.adv_phase_time_us[ctx.adv_phase] += now - ctx.adv_phase_begin_time;
+    }
+    ctx.adv_phase = phase;
+    ctx.adv_phase_begin_time = now;
+
+    if (phase == ADV_PHASE_NONE)
+    {
+        ESP_LOGI(TAG, "Advertising time (s): directed=%"PRIu64" fast=%"PRIu64" slow=%"PRIu64" idle=%"PRIu64,
+                 ctx.adv_phase_time_us[ADV_PHASE_DIRECTED] / 1000000,
+                 ctx.adv_phase_time_us[ADV_PHASE_FAST] / 1000000,
+                 ctx.adv_phase_time_us[ADV_PHASE_SLOW] / 1000000,
+                 ctx.adv_phase_time_us[ADV_PHASE_IDLE] / 1000000);
+    }
+}
+
+static adv_phase_t first_adv_phase(void)
+{
+#if CONFIG_VLINK_BLE_BONDING
+    if (ctx.has_bonded_peer && CONFIG_VLINK_BLE_DIRECTED_ADV_MS > 0)
+    {
+        return ADV_PHASE_DIRECTED;
+    }
+#endif
+    return ADV_PHASE_FAST;
+}
+
+static void start_advertising(adv_phase_t phase)
 {
     esp_err_t err;
+    uint32_t interval_ms = 0;
+    uint64_t duration_ms = 0;
+
+    ADV_PARAMS.adv_type = ADV_TYPE_IND;
+    ADV_PARAMS.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY;
+
+    switch (phase)
+    {
+    case ADV_PHASE_NONE:
+    case ADV_PHASE_COUNT:
+        return;
+    case ADV_PHASE_DIRECTED:
+#if CONFIG_VLINK_BLE_BONDING
+        // High duty cycle directed advertising ignores the interval
+        ADV_PARAMS.adv_type = ADV_TYPE_DIRECT_IND_HIGH;
+        memcpy(ADV_PARAMS.peer_addr, ctx.bonded_peer.addr, sizeof(esp_bd_addr_t));
+        ADV_PARAMS.peer_addr_type = ctx.bonded_peer.addr_type;
+        duration_ms = CONFIG_VLINK_BLE_DIRECTED_ADV_MS;
+        ESP_LOGI(TAG, "Directed advertising to %02x:%02x:%02x:%02x:%02x:%02x",
+                 ctx.bonded_peer.addr[0],
+                 ctx.bonded_peer.addr[1],
+                 ctx.bonded_peer.addr[2],
+                 ctx.bonded_peer.addr[3],
+                 ctx.bonded_peer.addr[4],
+                 ctx.bonded_peer.addr[5]);
+#endif
+        break;
+    case ADV_PHASE_FAST:
+        interval_ms = CONFIG_VLINK_ADV_FAST_INTERVAL_MS;
+        duration_ms = CONFIG_VLINK_ADV_FAST_DURATION_S * 1000ULL;
+        break;
+    case ADV_PHASE_SLOW:
+        interval_ms = CONFIG_VLINK_ADV_SLOW_INTERVAL_MS;
+        duration_ms = CONFIG_VLINK_ADV_SLOW_DURATION_S * 1000ULL;
+        break;
+    case ADV_PHASE_IDLE:
+        interval_ms = CONFIG_VLINK_ADV_IDLE_INTERVAL_MS;
+        break;
+    }
+
+    if (interval_ms > 0)
+    {
+        uint32_t max_units = 2 * ADV_INTERVAL_UNITS(interval_ms);
+        ADV_PARAMS.adv_int_min = ADV_INTERVAL_UNITS(interval_ms);
+        ADV_PARAMS.adv_int_max = max_units > 0x4000 ? 0x4000 : max_units;
+#if CONFIG_VLINK_BLE_ADV_WHITELIST
+        if (ctx.has_bonded_peer)
+        {
+            ADV_PARAMS.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST;
+        }
+#endif
+        ESP_LOGI(TAG, "Advertising phase %s, interval %"PRIu32" ms",
+                 ADV_PHASE_NAMES[phase],
+                 interval_ms);
+    }
+
+    set_adv_phase(phase);
+    if (duration_ms > 0)
+    {
+        esp_timer_start_once(ctx.adv_timer, duration_ms * 1000);
+    }
 
     err = esp_ble_gap_start_advertising(&ADV_PARAMS);
     if (err)
@@ -100,6 +316,137 @@ static void start_advertising(void)
     }
 }
 
+static void on_adv_timeout(void *arg)
+{
+    // Runs in the esp_timer task, the next phase is started from the
+    // stop event so that the phase is only touched by the BTC task
+    esp_err_t err = esp_ble_gap_stop_advertising();
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gap_stop_advertising failed: %d", err);
+    }
+}
+
+#if CONFIG_VLINK_BLE_BONDING
+static void set_bonded_peer(const peer_t *peer)
+{
+    ctx.bonded_peer = *peer;
+    ctx.has_bonded_peer = true;
+
+#if CONFIG_VLINK_BLE_ADV_WHITELIST
+    esp_err_t err = esp_ble_gap_update_whitelist(true,
+                                                 ctx.bonded_peer.addr,
+                                                 ctx.bonded_peer.addr_type == BLE_ADDR_TYPE_PUBLIC
+                                                     ? BLE_WL_ADDR_TYPE_PUBLIC
+                                                     : BLE_WL_ADDR_TYPE_RANDOM);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gap_update_whitelist failed: %d", err);
+    }
+#endif
+}
+
+static bool find_bond_identity(const esp_bd_addr_t addr, peer_t *peer)
+{
+    static esp_ble_bond_dev_t devs[CONFIG_BT_SMP_MAX_BONDS];
+    int count = sizeof(devs) / sizeof(devs[0]);
+    if (esp_ble_get_bond_device_list(&count, devs) != ESP_OK)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (memcmp(devs[i].bd_addr, addr, sizeof(esp_bd_addr_t)) != 0
+            && memcmp(devs[i].bond_key.pid_key.static_addr, addr, sizeof(esp_bd_addr_t)) != 0)
+        {
+            continue;
+        }
+
+        if (devs[i].bond_key.key_mask & ESP_BLE_ID_KEY_MASK)
+        {
+            // Phones connect with a resolvable private address, target the
+            // identity address distributed during bonding instead
+            memcpy(peer->addr, devs[i].bond_key.pid_key.static_addr, sizeof(esp_bd_addr_t));
+            peer->addr_type = devs[i].bond_key.pid_key.addr_type;
+        }
+        else
+        {
+            memcpy(peer->addr, devs[i].bd_addr, sizeof(esp_bd_addr_t));
+        }
+        return true;
+    }
+    return false;
+}
+
+static void load_bonded_peer(void)
+{
+    peer_t peer;
+    if (!nvsstore_load_blob(NVS_NAMESPACE, NVS_KEY_LAST_PEER, &peer, sizeof(peer)))
+    {
+        return;
+    }
+
+    // The bond may have been removed since the peer was saved
+    peer_t bond;
+    bond.addr_type = peer.addr_type;
+    if (find_bond_identity(peer.addr, &bond))
+    {
+        set_bonded_peer(&bond);
+    }
+}
+
+static void save_bonded_peer(void)
+{
+    nvsstore_save_blob(NVS_NAMESPACE, NVS_KEY_LAST_PEER, &ctx.bonded_peer, sizeof(ctx.bonded_peer));
+}
+
+static void handle_auth_complete(esp_ble_auth_cmpl_t *auth_cmpl)
+{
+    if (!auth_cmpl->success)
+    {
+        ESP_LOGW(TAG, "ESP_GAP_BLE_AUTH_CMPL_EVT failed: 0x%x", auth_cmpl->fail_reason);
+        return;
+    }
+
+    peer_t peer = {
+        .addr_type = auth_cmpl->addr_type,
+    };
+    memcpy(peer.addr, auth_cmpl->bd_addr, sizeof(esp_bd_addr_t));
+    find_bond_identity(auth_cmpl->bd_addr, &peer);
+
+    if (!ctx.has_bonded_peer || memcmp(&peer, &ctx.bonded_peer, sizeof(peer)) != 0)
+    {
+        set_bonded_peer(&peer);
+        save_bonded_peer();
+    }
+}
+
+static void init_security(void)
+{
+    esp_err_t err = ESP_OK;
+
+    esp_ble_auth_req_t auth_req = ESP_LE_AUTH_REQ_SC_BOND;
+    esp_ble_io_cap_t iocap = ESP_IO_CAP_NONE;
+    uint8_t key_size = 16;
+    uint8_t init_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+    uint8_t rsp_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+
+    err |= esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &auth_req, sizeof(auth_req));
+    err |= esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &iocap, sizeof(iocap));
+    err |= esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(key_size));
+    err |= esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &init_key, sizeof(init_key));
+    err |= esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rsp_key, sizeof(rsp_key));
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_ble_gap_set_security_param failed: %d", err);
+        panic(PANIC_ID_GATTCOMM_SET_SECURITY_PARAM_FAILED);
+    }
+
+    load_bonded_peer();
+}
+#endif
+
 static void gap_event_handler(esp_gap_ble_cb_event_t event,
                               esp_ble_gap_cb_param_t *param)
 {
@@ -110,7 +457,8 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event,
         ctx.adv_data_complete = true;
         if (ctx.adv_data_complete && ctx.scan_rsp_data_complete)
         {
-            start_advertising();
+            bootprof_mark(BOOT_PHASE_ADV_DATA_SET);
+            start_advertising(first_adv_phase());
         }
         break;
 
@@ -119,7 +467,8 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event,
         ctx.scan_rsp_data_complete = true;
         if (ctx.adv_data_complete && ctx.scan_rsp_data_complete)
         {
-            start_advertising();
+            bootprof_mark(BOOT_PHASE_ADV_DATA_SET);
+            start_advertising(first_adv_phase());
         }
         break;
 
@@ -131,15 +480,48 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event,
                      param->adv_start_cmpl.status);
             panic(PANIC_ID_GATTCOMM_ADV_START_FAILED2);
         }
+        bootprof_mark(BOOT_PHASE_ADV_STARTED);
+        break;
+
+    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+        ESP_LOGI(TAG, "ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT");
+        // Directed advertising may also have timed out in the controller
+        // already, so the status is ignored
+        if (ctx.conn_id == CONN_ID_INVALID && ctx.adv_phase != ADV_PHASE_IDLE)
+        {
+            start_advertising(ctx.adv_phase + 1);
+        }
         break;
 
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+        ESP_LOGI(TAG, "ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT: status=%d", param->update_conn_params.status);
+        if (param->update_conn_params.status == ESP_BT_STATUS_SUCCESS)
+        {
+            coex_on_ble_conn_params(param->update_conn_params.conn_int, param->update_conn_params.latency);
+        }
+        break;
+
+#if CONFIG_VLINK_BLE_BONDING
+    case ESP_GAP_BLE_SEC_REQ_EVT:
+        ESP_LOGI(TAG, "ESP_GAP_BLE_SEC_REQ_EVT");
+        esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
+        break;
+
+    case ESP_GAP_BLE_AUTH_CMPL_EVT:
+        ESP_LOGI(TAG, "ESP_GAP_BLE_AUTH_CMPL_EVT");
+        handle_auth_complete(&param->ble_security.auth_cmpl);
+        break;
+#endif
+
     default:
         break;
     }
 }
 
 static void handle_cccd_write(esp_gatt_if_t gatts_if,
-                              esp_ble_gatts_cb_param_t *param)
+                              esp_ble_gatts_cb_param_t *param,
+                              uint16_t char_handle,
+                              bool *notify_enabled)
 {
     esp_err_t err;
 
@@ -152,10 +534,10 @@ static void handle_cccd_write(esp_gatt_if_t gatts_if,
     if ((param->write.value[0] & 1))
     {
         ESP_LOGI(TAG, "ESP_GATTS_WRITE_EVT notify enabled");
-        ctx.notify_enabled = true;
+        *notify_enabled = true;
         err = esp_ble_gatts_send_indicate(gatts_if,
                                             param->write.conn_id,
-                                            ctx.char_handle,
+                                            char_handle,
                                             0,
                                             NULL,
                                             false);
@@ -167,22 +549,176 @@ static void handle_cccd_write(esp_gatt_if_t gatts_if,
     else
     {
         ESP_LOGI(TAG, "ESP_GATTS_WRITE_EVT notify disabled");
-        ctx.notify_enabled = false;
+        *notify_enabled = false;
     }
 }
 
-static void handle_char_write(esp_gatt_if_t gatts_if,
-                              esp_ble_gatts_cb_param_t *param)
+static void clear_write_rsp(void)
 {
-    app_on_gatt_rx(param->write.value, param->write.len);
+    taskENTER_CRITICAL(&write_rsp_mux);
+    ctx.write_rsp_pending = false;
+    taskEXIT_CRITICAL(&write_rsp_mux);
+}
+
+static void forward_client_data(uint16_t conn_id,
+                                uint32_t trans_id,
+                                bool need_rsp,
+                                const uint8_t *data,
+                                uint16_t length)
+{
+    // Recorded before the data is handed over, the bridge may resume
+    // from another task before app_on_gatt_rx() returns
+    if (need_rsp)
+    {
+        taskENTER_CRITICAL(&write_rsp_mux);
+        ctx.write_rsp_pending = true;
+        ctx.write_rsp_conn_id = conn_id;
+        ctx.write_rsp_trans_id = trans_id;
+        taskEXIT_CRITICAL(&write_rsp_mux);
+    }
+
+    bool accepted = app_on_gatt_rx(data, length);
 
     static const char ATZ[4] = "ATZ\r";
-    if (param->write.len == sizeof(ATZ) && 
-        memcmp(param->write.value, ATZ, sizeof(ATZ)) == 0)
+    if (length == sizeof(ATZ) &&
+        memcmp(data, ATZ, sizeof(ATZ)) == 0)
     {
         ESP_LOGI(TAG, "Received ATZ command, waiting 500ms");
         vTaskDelay(pdMS_TO_TICKS(500));
     }
+
+    if (accepted)
+    {
+        gattcomm_resume_rx();
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Bridge busy, holding write response");
+        ctx.write_rsp_holds++;
+    }
+}
+
+static void send_write_response(esp_gatt_if_t gatts_if,
+                                uint16_t conn_id,
+                                uint32_t trans_id,
+                                esp_gatt_status_t status,
+                                esp_gatt_rsp_t *rsp)
+{
+    esp_err_t err = esp_ble_gatts_send_response(gatts_if,
+                                                conn_id,
+                                                trans_id,
+                                                status,
+                                                rsp);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gatts_send_response failed: %d", err);
+        gattcomm_disconnect();
+    }
+}
+
+static void handle_prep_write(esp_gatt_if_t gatts_if,
+                              esp_ble_gatts_cb_param_t *param)
+{
+    if (param->write.handle != ctx.char_handle)
+    {
+        send_write_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_REQ_NOT_SUPPORTED, NULL);
+        return;
+    }
+
+    // Once the batch does not fit, reject every remaining part so the
+    // client cancels it instead of a truncated batch being executed
+    if (ctx.prep_overflow
+        || param->write.offset + param->write.len > sizeof(ctx.prep_buffer))
+    {
+        ESP_LOGW(TAG, "Prepared write exceeds %d bytes", CONFIG_VLINK_PREP_WRITE_MAX_LEN);
+        ctx.prep_overflow = true;
+        send_write_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_PREPARE_Q_FULL, NULL);
+        return;
+    }
+
+    memcpy(ctx.prep_buffer + param->write.offset, param->write.value, param->write.len);
+    if (param->write.offset + param->write.len > ctx.prep_len)
+    {
+        ctx.prep_len = param->write.offset + param->write.len;
+    }
+
+    // The prepare write response echoes the part back
+    static esp_gatt_rsp_t rsp;
+    rsp.attr_value.handle = param->write.handle;
+    rsp.attr_value.offset = param->write.offset;
+    rsp.attr_value.len = param->write.len;
+    rsp.attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+    memcpy(rsp.attr_value.value, param->write.value, param->write.len);
+    send_write_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, &rsp);
+}
+
+static void handle_exec_write(esp_gatt_if_t gatts_if,
+                              esp_ble_gatts_cb_param_t *param)
+{
+    uint16_t length = ctx.prep_len;
+    bool execute = param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC
+                   && !ctx.prep_overflow;
+    ctx.prep_len = 0;
+    ctx.prep_overflow = false;
+
+    if (!execute || length == 0)
+    {
+        send_write_response(gatts_if,
+                            param->exec_write.conn_id,
+                            param->exec_write.trans_id,
+                            ESP_GATT_OK,
+                            NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Executing prepared write of %d bytes", length);
+    ctx.prep_batches++;
+    forward_client_data(param->exec_write.conn_id,
+                        param->exec_write.trans_id,
+                        true,
+                        ctx.prep_buffer,
+                        length);
+}
+
+static void handle_stats_read(esp_gatt_if_t gatts_if,
+                              esp_ble_gatts_cb_param_t *param)
+{
+    if (param->read.offset == 0)
+    {
+        ctx.stats_snapshot_len = stats_format(ctx.stats_snapshot, sizeof(ctx.stats_snapshot));
+    }
+
+    static esp_gatt_rsp_t rsp;
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.attr_value.handle = param->read.handle;
+    rsp.attr_value.offset = param->read.offset;
+
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (param->read.offset > ctx.stats_snapshot_len)
+    {
+        status = ESP_GATT_INVALID_OFFSET;
+    }
+    else
+    {
+        uint16_t length = ctx.stats_snapshot_len - param->read.offset;
+        if (length > ctx.mtu - 1)
+        {
+            length = ctx.mtu - 1;
+        }
+        memcpy(rsp.attr_value.value, ctx.stats_snapshot + param->read.offset, length);
+        rsp.attr_value.len = length;
+    }
+
+    esp_err_t err = esp_ble_gatts_send_response(gatts_if,
+                                                param->read.conn_id,
+                                                param->read.trans_id,
+                                                status,
+                                                &rsp);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gatts_send_response failed: %d", err);
+        gattcomm_disconnect();
+    }
 }
 
 static void gatts_event_handler(esp_gatts_cb_event_t event,
@@ -203,27 +739,7 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
             panic(PANIC_ID_GATTCOMM_GATTS_REG_EVT_FAILED);
         }
         ctx.gatts_if = gatts_if;
-
-        err = esp_ble_gap_set_device_name(BT_DEVICE_NAME);
-        if (err)
-        {
-            ESP_LOGE(TAG, "esp_ble_gap_set_device_name failed: %d", err);
-            panic(PANIC_ID_GATTCOMM_SET_DEVICE_NAME_FAILED);
-        }
-
-        err = esp_ble_gap_config_adv_data(&ADV_DATA);
-        if (err)
-        {
-            ESP_LOGE(TAG, "esp_ble_gap_config_adv_data failed: %d", err);
-            panic(PANIC_ID_GATTCOMM_CONFIG_ADV_DATA_FAILED);
-        }
-
-        err = esp_ble_gap_config_adv_data(&SCAN_RSP_DATA);
-        if (err)
-        {
-            ESP_LOGE(TAG, "esp_ble_gap_config_adv_data failed: %d", err);
-            panic(PANIC_ID_GATTCOMM_CONFIG_SCAN_RSP_DATA_FAILED);
-        }
+        bootprof_mark(BOOT_PHASE_GATTS_REGISTERED);
 
         err = esp_ble_gatts_create_service(gatts_if, &SERVICE_ID, 16);
         if (err)
@@ -259,7 +775,54 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
 
     case ESP_GATTS_ADD_CHAR_EVT:
         ESP_LOGI(TAG, "ESP_GATTS_ADD_CHAR_EVT");
-        ctx.char_handle = param->add_char.attr_handle;
+        if (memcmp(param->add_char.char_uuid.uuid.uuid128,
+                   STATS_UUID.uuid.uuid128,
+                   ESP_UUID_LEN_128) == 0)
+        {
+            ctx.stats_char_handle = param->add_char.attr_handle;
+
+            err = esp_ble_gatts_add_char(ctx.service_handle,
+                                         &CONTROL_UUID,
+                                         ESP_GATT_PERM_WRITE,
+                                         ESP_GATT_CHAR_PROP_BIT_WRITE,
+                                         NULL,
+                                         NULL);
+            if (err)
+            {
+                ESP_LOGE(TAG, "esp_ble_gatts_add_char failed: %d", err);
+                panic(PANIC_ID_GATTCOMM_ADD_CHAR_FAILED);
+            }
+            break;
+        }
+        if (memcmp(param->add_char.char_uuid.uuid.uuid128,
+                   CONTROL_UUID.uuid.uuid128,
+                   ESP_UUID_LEN_128) == 0)
+        {
+            ctx.control_char_handle = param->add_char.attr_handle;
+
+            err = esp_ble_gatts_add_char(ctx.service_handle,
+                                         &LOG_UUID,
+                                         0,
+                                         ESP_GATT_CHAR_PROP_BIT_NOTIFY,
+                                         NULL,
+                                         NULL);
+            if (err)
+            {
+                ESP_LOGE(TAG, "esp_ble_gatts_add_char failed: %d", err);
+                panic(PANIC_ID_GATTCOMM_ADD_CHAR_FAILED);
+            }
+            break;
+        }
+        if (memcmp(param->add_char.char_uuid.uuid.uuid128,
+                   LOG_UUID.uuid.uuid128,
+                   ESP_UUID_LEN_128) == 0)
+        {
+            ctx.log_char_handle = param->add_char.attr_handle;
+        }
+        else
+        {
+            ctx.char_handle = param->add_char.attr_handle;
+        }
 
         err = esp_ble_gatts_add_char_descr(ctx.service_handle,
                                            &CCCD_UUID,
@@ -274,7 +837,31 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
 
     case ESP_GATTS_ADD_CHAR_DESCR_EVT:
         ESP_LOGI(TAG, "ESP_GATTS_ADD_CHAR_DESCR_EVT");
+        // The log characteristic is added last
+        if (ctx.log_char_handle != 0)
+        {
+            ctx.log_cccd_handle = param->add_char_descr.attr_handle;
+            bootprof_mark(BOOT_PHASE_GATT_SERVICE_READY);
+            break;
+        }
         ctx.cccd_handle = param->add_char_descr.attr_handle;
+
+        err = esp_ble_gatts_add_char(ctx.service_handle,
+                                     &STATS_UUID,
+                                     ESP_GATT_PERM_READ,
+                                     ESP_GATT_CHAR_PROP_BIT_READ,
+                                     NULL,
+                                     NULL);
+        if (err)
+        {
+            ESP_LOGE(TAG, "esp_ble_gatts_add_char failed: %d", err);
+            panic(PANIC_ID_GATTCOMM_ADD_CHAR_FAILED);
+        }
+        break;
+
+    case ESP_GATTS_MTU_EVT:
+        ESP_LOGI(TAG, "ESP_GATTS_MTU_EVT: %d", param->mtu.mtu);
+        ctx.mtu = param->mtu.mtu;
         break;
 
     case ESP_GATTS_CONNECT_EVT:
@@ -286,7 +873,27 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
             break;
         }
         ctx.conn_id = param->connect.conn_id;
+        ctx.mtu = DEFAULT_MTU;
         ctx.notify_enabled = false;
+        ctx.log_notify_enabled = false;
+        ctx.congested = false;
+#if CONFIG_VLINK_BLE_COMPRESSION
+        ctx.compression = false;
+        ctx.pending_len = 0;
+#endif
+        bootprof_mark(BOOT_PHASE_FIRST_CONNECT);
+        esp_timer_stop(ctx.adv_timer);
+        set_adv_phase(ADV_PHASE_NONE);
+        coex_on_ble_conn_params(param->connect.conn_params.interval, param->connect.conn_params.latency);
+        coex_on_ble_connected(param->connect.remote_bda);
+#if CONFIG_VLINK_BLE_BONDING
+        err = esp_ble_set_encryption(param->connect.remote_bda,
+                                     ESP_BLE_SEC_ENCRYPT_NO_MITM);
+        if (err)
+        {
+            ESP_LOGW(TAG, "esp_ble_set_encryption failed: %d", err);
+        }
+#endif
         app_on_gatt_connected();
         break;
 
@@ -294,7 +901,10 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
         ESP_LOGI(TAG, "~~~~~~~~~~ ESP_GATTS_DISCONNECT_EVT: %d ~~~~~~~~~~",
                  param->disconnect.reason);
         ctx.conn_id = CONN_ID_INVALID;
-        start_advertising();
+        ctx.prep_len = 0;
+        ctx.prep_overflow = false;
+        clear_write_rsp();
+        start_advertising(first_adv_phase());
         app_on_gatt_disconnected();
         break;
 
@@ -304,10 +914,15 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
                  param->read.trans_id,
                  param->read.handle,
                  param->read.offset);
+        if (param->read.handle == ctx.stats_char_handle)
+        {
+            handle_stats_read(gatts_if, param);
+            break;
+        }
         esp_gatt_rsp_t rsp = {
             .attr_value.handle = param->read.handle,
             .attr_value.len = 2,
-            .attr_value.value = { ctx.notify_enabled, 0 }, 
+            .attr_value.value = { param->read.handle == ctx.log_cccd_handle ? ctx.log_notify_enabled : ctx.notify_enabled, 0 }, 
         };
         err = esp_ble_gatts_send_response(gatts_if,
                                           param->read.conn_id,
@@ -330,24 +945,42 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
 
         if (param->write.is_prep)
         {
-            ESP_LOGW(TAG, "ESP_GATTS_WRITE_EVT prepare write not supported");
-            gattcomm_disconnect();
+            handle_prep_write(gatts_if, param);
+            break;
+        }
+
+        if (param->write.handle == ctx.char_handle)
+        {
+            // Responded to once the bridge has taken the data
+            forward_client_data(param->write.conn_id,
+                                param->write.trans_id,
+                                param->write.need_rsp,
+                                param->write.value,
+                                param->write.len);
             break;
         }
 
+        esp_gatt_status_t status = ESP_GATT_OK;
         if (param->write.handle == ctx.cccd_handle)
         {
-            handle_cccd_write(gatts_if, param);
+            handle_cccd_write(gatts_if, param, ctx.char_handle, &ctx.notify_enabled);
+        }
+        else if (param->write.handle == ctx.log_cccd_handle)
+        {
+            handle_cccd_write(gatts_if, param, ctx.log_char_handle, &ctx.log_notify_enabled);
         }
-        else if (param->write.handle == ctx.char_handle)
+        else if (param->write.handle == ctx.control_char_handle)
         {
-            handle_char_write(gatts_if, param);
+            if (!app_on_control(param->write.value, param->write.len))
+            {
+                status = ESP_GATT_ERROR;
+            }
         }
 
         err = esp_ble_gatts_send_response(gatts_if,
                                           param->write.conn_id,
                                           param->write.trans_id,
-                                          ESP_GATT_OK,
+                                          status,
                                           NULL);
         if (err)
         {
@@ -356,9 +989,18 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
         }
         break;
 
+    case ESP_GATTS_CONGEST_EVT:
+        ESP_LOGD(TAG, "ESP_GATTS_CONGEST_EVT: %d", param->congest.congested);
+        if (param->congest.congested && !ctx.congested)
+        {
+            ctx.congestions++;
+        }
+        ctx.congested = param->congest.congested;
+        break;
+
     case ESP_GATTS_EXEC_WRITE_EVT:
-        ESP_LOGW(TAG, "ESP_GATTS_EXEC_WRITE_EVT not supported");
-        gattcomm_disconnect();
+        ESP_LOGI(TAG, "ESP_GATTS_EXEC_WRITE_EVT: flag=%d", param->exec_write.exec_write_flag);
+        handle_exec_write(gatts_if, param);
         break;
 
     default:
@@ -366,12 +1008,176 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
     }
 }
 
+static void record_notify(uint16_t length)
+{
+    int64_t now = esp_timer_get_time();
+    if (now - ctx.notify_window_start >= 1000000)
+    {
+        ctx.notify_window_start = now;
+        ctx.notify_window_bytes = 0;
+    }
+    ctx.notify_bytes += length;
+    ctx.notify_count++;
+    ctx.notify_window_bytes += length;
+    if (ctx.notify_window_bytes > ctx.notify_peak)
+    {
+        ctx.notify_peak = ctx.notify_window_bytes;
+    }
+}
+
+static void notify_data(const uint8_t *data, uint16_t length)
+{
+    // Notifications longer than the MTU allows would be truncated
+    while (ctx.conn_id != CONN_ID_INVALID && ctx.notify_enabled && length > 0)
+    {
+        uint16_t chunk = ctx.mtu - 3;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        esp_err_t err = esp_ble_gatts_send_indicate(ctx.gatts_if,
+                                                    ctx.conn_id,
+                                                    ctx.char_handle,
+                                                    chunk,
+                                                    (uint8_t *)data,
+                                                    false);
+        if (err)
+        {
+            ESP_LOGW(TAG, "esp_ble_gatts_send_indicate failed: %d", err);
+            gattcomm_disconnect();
+            return;
+        }
+        record_notify(chunk);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+#if CONFIG_VLINK_BLE_COMPRESSION
+// Output from the threshold up goes out as blocks when that makes it
+// shorter. The client's window takes plain output as well.
+static void send_unit(const uint8_t *data, uint16_t unit)
+{
+    bool has_marker = memchr(data, BLOCK_MARKER, unit) != NULL;
+    if (unit < CONFIG_VLINK_BLE_COMPRESS_THRESHOLD && !has_marker)
+    {
+        lzss_append(data, unit);
+        notify_data(data, unit);
+        return;
+    }
+
+    uint16_t packed = lzss_compress(data, unit, ctx.block + BLOCK_HEADER_LEN);
+    if (packed + BLOCK_HEADER_LEN < unit || has_marker)
+    {
+        ctx.block[0] = BLOCK_MARKER;
+        ctx.block[1] = unit;
+        ctx.block[2] = unit >> 8;
+        ctx.block[3] = packed;
+        ctx.block[4] = packed >> 8;
+        notify_data(ctx.block, BLOCK_HEADER_LEN + packed);
+    }
+    else
+    {
+        notify_data(data, unit);
+    }
+}
+
+// Called with tx_lock held
+static void flush_pending(void)
+{
+    esp_timer_stop(ctx.flush_timer);
+    if (ctx.pending_len > 0)
+    {
+        send_unit(ctx.pending, ctx.pending_len);
+        ctx.pending_len = 0;
+    }
+}
+
+static void on_flush_timer(void *arg)
+{
+    xSemaphoreTake(ctx.tx_lock, portMAX_DELAY);
+    flush_pending();
+    xSemaphoreGive(ctx.tx_lock);
+}
+
+// The bridge hands over output as SPP delivers it, mostly well under the
+// threshold. It is held until the prompt, a full unit or a quiet spell so
+// that the whole reply is what gets compressed.
+static void tx_compressed(const uint8_t *data, uint16_t length)
+{
+    xSemaphoreTake(ctx.tx_lock, portMAX_DELAY);
+    while (length > 0)
+    {
+        uint16_t room = LZSS_UNIT_MAX - ctx.pending_len;
+        uint16_t n = length < room ? length : room;
+        bool prompt = memchr(data, '>', n) != NULL;
+        memcpy(ctx.pending + ctx.pending_len, data, n);
+        ctx.pending_len += n;
+        data += n;
+        length -= n;
+        if (prompt || ctx.pending_len == LZSS_UNIT_MAX)
+        {
+            flush_pending();
+        }
+    }
+    if (ctx.pending_len > 0)
+    {
+        esp_timer_stop(ctx.flush_timer);
+        esp_timer_start_once(ctx.flush_timer, COMPRESS_FLUSH_MS * 1000);
+    }
+    xSemaphoreGive(ctx.tx_lock);
+}
+
+void gattcomm_set_compression(bool enabled)
+{
+    xSemaphoreTake(ctx.tx_lock, portMAX_DELAY);
+    // Held output belongs to the old state
+    flush_pending();
+    // Both ends start from an empty window
+    ctx.compression = enabled;
+    lzss_reset();
+    xSemaphoreGive(ctx.tx_lock);
+    ESP_LOGI(TAG, "Compression %s", enabled ? "on" : "off");
+}
+#endif
+
 void gattcomm_init(void)
 {
     esp_err_t err;
 
     ctx.conn_id = CONN_ID_INVALID;
 
+#if CONFIG_VLINK_BLE_COMPRESSION
+    ctx.tx_lock = xSemaphoreCreateMutexStatic(&ctx.tx_lock_buffer);
+    if (ctx.tx_lock == NULL)
+    {
+        ESP_LOGE(TAG, "xSemaphoreCreateMutexStatic failed");
+        panic(PANIC_ID_GATTCOMM_CREATE_MUTEX_FAILED);
+    }
+
+    const esp_timer_create_args_t flush_timer_args = {
+        .callback = on_flush_timer,
+        .name = "compress_flush",
+    };
+    err = esp_timer_create(&flush_timer_args, &ctx.flush_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(PANIC_ID_GATTCOMM_TIMER_CREATE_FAILED);
+    }
+#endif
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = on_adv_timeout,
+        .name = "adv_phase",
+    };
+    err = esp_timer_create(&timer_args, &ctx.adv_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(PANIC_ID_GATTCOMM_TIMER_CREATE_FAILED);
+    }
+
     err = esp_ble_gap_register_callback(gap_event_handler);
     if (err)
     {
@@ -386,6 +1192,33 @@ void gattcomm_init(void)
         panic(PANIC_ID_GATTCOMM_GATTS_REGISTER_FAILED);
     }
 
+#if CONFIG_VLINK_BLE_BONDING
+    init_security();
+#endif
+
+    // The advertising data does not depend on the GATT server, configure
+    // it while the service is being registered to start advertising sooner
+    err = esp_ble_gap_set_device_name(BT_DEVICE_NAME);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_ble_gap_set_device_name failed: %d", err);
+        panic(PANIC_ID_GATTCOMM_SET_DEVICE_NAME_FAILED);
+    }
+
+    err = esp_ble_gap_config_adv_data(&ADV_DATA);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_ble_gap_config_adv_data failed: %d", err);
+        panic(PANIC_ID_GATTCOMM_CONFIG_ADV_DATA_FAILED);
+    }
+
+    err = esp_ble_gap_config_adv_data(&SCAN_RSP_DATA);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_ble_gap_config_adv_data failed: %d", err);
+        panic(PANIC_ID_GATTCOMM_CONFIG_SCAN_RSP_DATA_FAILED);
+    }
+
     err = esp_ble_gatts_app_register(0);
     if (err)
     {
@@ -403,6 +1236,22 @@ void gattcomm_init(void)
     ESP_LOGI(TAG, "gattcomm_init success");
 }
 
+void gattcomm_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "adv_s=directed:%"PRIu64",fast:%"PRIu64",slow:%"PRIu64",idle:%"PRIu64"\n",
+                 ctx.adv_phase_time_us[ADV_PHASE_DIRECTED] / 1000000,
+                 ctx.adv_phase_time_us[ADV_PHASE_FAST] / 1000000,
+                 ctx.adv_phase_time_us[ADV_PHASE_SLOW] / 1000000,
+                 ctx.adv_phase_time_us[ADV_PHASE_IDLE] / 1000000);
+    stats_printf(writer, "rx_holds=%"PRIu32" prep_batches=%"PRIu32" congestions=%"PRIu32"\n",
+                 ctx.write_rsp_holds,
+                 ctx.prep_batches,
+                 ctx.congestions);
+    stats_printf(writer, "notify=%"PRIu32"B peak:%"PRIu32"B/s\n",
+                 ctx.notify_bytes,
+                 ctx.notify_peak);
+}
+
 void gattcomm_disconnect(void)
 {
     if (ctx.conn_id != CONN_ID_INVALID)
@@ -413,18 +1262,74 @@ void gattcomm_disconnect(void)
 
 void gattcomm_tx(const uint8_t *data, uint16_t length)
 {
-    if (ctx.conn_id != CONN_ID_INVALID && ctx.notify_enabled)
+#if CONFIG_VLINK_BLE_COMPRESSION
+    if (ctx.compression)
     {
-        esp_err_t err = esp_ble_gatts_send_indicate(ctx.gatts_if,
-                                                    ctx.conn_id,
-                                                    ctx.char_handle,
-                                                    length,
-                                                    (uint8_t *)data,
-                                                    false);
-        if (err)
-        {
-            ESP_LOGW(TAG, "esp_ble_gatts_send_indicate failed: %d", err);
-            gattcomm_disconnect();
-        }
+        tx_compressed(data, length);
+        return;
+    }
+#endif
+    notify_data(data, length);
+}
+
+bool gattcomm_log_tx(const uint8_t *data, uint16_t length)
+{
+    if (ctx.conn_id == CONN_ID_INVALID || !ctx.log_notify_enabled || length > ctx.mtu - 3)
+    {
+        return false;
+    }
+    esp_err_t err = esp_ble_gatts_send_indicate(ctx.gatts_if,
+                                                ctx.conn_id,
+                                                ctx.log_char_handle,
+                                                length,
+                                                (uint8_t *)data,
+                                                false);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gatts_send_indicate failed: %d", err);
+        return false;
+    }
+    record_notify(length);
+    return true;
+}
+
+uint16_t gattcomm_get_tx_size(void)
+{
+    return ctx.mtu - 3;
+}
+
+uint32_t gattcomm_get_notify_count(void)
+{
+    return ctx.notify_count;
+}
+
+bool gattcomm_is_congested(void)
+{
+    return ctx.congested;
+}
+
+void gattcomm_resume_rx(void)
+{
+    taskENTER_CRITICAL(&write_rsp_mux);
+    bool pending = ctx.write_rsp_pending;
+    uint16_t conn_id = ctx.write_rsp_conn_id;
+    uint32_t trans_id = ctx.write_rsp_trans_id;
+    ctx.write_rsp_pending = false;
+    taskEXIT_CRITICAL(&write_rsp_mux);
+
+    if (!pending)
+    {
+        return;
+    }
+
+    esp_err_t err = esp_ble_gatts_send_response(ctx.gatts_if,
+                                                conn_id,
+                                                trans_id,
+                                                ESP_GATT_OK,
+                                                NULL);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_ble_gatts_send_response failed: %d", err);
+        gattcomm_disconnect();
     }
 }
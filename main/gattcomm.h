@@ -1,6 +1,18 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
 
 void gattcomm_init(void);
 void gattcomm_disconnect(void);
 void gattcomm_tx(const uint8_t *data, uint16_t length);
+// Data sent from now on may be compressed, see lzss.h
+void gattcomm_set_compression(bool enabled);
+// One notification on the log characteristic, false when it cannot go out
+bool gattcomm_log_tx(const uint8_t *data, uint16_t length);
+uint16_t gattcomm_get_tx_size(void);
+// Notifications sent since boot, on any characteristic
+uint32_t gattcomm_get_notify_count(void);
+bool gattcomm_is_congested(void);
+void gattcomm_resume_rx(void);
+void gattcomm_write_stats(stats_writer_t *writer);
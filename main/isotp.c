@@ -0,0 +1,304 @@
+#include "isotp.h"
+#include "elmcfg.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+
+#define TAG              "ISOTP"
+#define MAX_MESSAGES     8
+#define MAX_PAYLOAD      256
+// "18 DA F1 10" with spaces
+#define MAX_HEADER_LEN   12
+#define MAX_FRAME_BYTES  8
+// Header, PCI and payload bytes with separators
+#define MAX_EMIT_LEN     (MAX_HEADER_LEN + (2 + MAX_PAYLOAD) * 3 + 2)
+
+#define PCI_SINGLE      0x0
+#define PCI_FIRST       0x1
+#define PCI_CONSECUTIVE 0x2
+
+typedef struct
+{
+    char header[MAX_HEADER_LEN];
+    uint8_t bytes[MAX_FRAME_BYTES];
+    int byte_count;
+    bool spaces;
+} frame_t;
+
+typedef struct
+{
+    bool used;
+    char header[MAX_HEADER_LEN];
+    bool spaces;
+    uint16_t length;
+    uint16_t received;
+    uint8_t next_seq;
+    bool broken;
+    uint8_t payload[MAX_PAYLOAD];
+} message_t;
+
+static struct
+{
+    message_t messages[MAX_MESSAGES];
+    char emit_buffer[MAX_EMIT_LEN];
+
+    uint32_t complete;
+    uint32_t incomplete;
+} ctx;
+
+// Parses a headers-on CAN line in either spacing. 11-bit headers are three
+// digits, 29-bit headers four bytes, so without spaces the header size
+// follows from whether the digit count is odd.
+static bool parse_frame(const char *line, uint16_t length, frame_t *frame)
+{
+    char digits[MAX_HEADER_LEN + 2 * MAX_FRAME_BYTES];
+    int digit_count = 0;
+    int first_token_len = -1;
+    frame->spaces = false;
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = line[i];
+        if (c == ' ')
+        {
+            if (digit_count > 0 && first_token_len < 0)
+            {
+                first_token_len = digit_count;
+            }
+            frame->spaces = digit_count > 0 || frame->spaces;
+            continue;
+        }
+        if (c == '\n')
+        {
+            continue;
+        }
+        if (elmcfg_hex_value(c) < 0 || digit_count == sizeof(digits))
+        {
+            return false;
+        }
+        digits[digit_count++] = c;
+    }
+
+    int header_digits;
+    if (frame->spaces)
+    {
+        if (first_token_len != 2 && first_token_len != 3)
+        {
+            return false;
+        }
+        header_digits = first_token_len == 3 ? 3 : 8;
+    }
+    else
+    {
+        header_digits = digit_count % 2 ? 3 : 8;
+    }
+
+    int data_digits = digit_count - header_digits;
+    if (data_digits < 2 || data_digits % 2 || data_digits > 2 * MAX_FRAME_BYTES)
+    {
+        return false;
+    }
+
+    // Kept in the client's format for the reassembled line
+    int n = 0;
+    for (int i = 0; i < header_digits; i++)
+    {
+        if (frame->spaces && header_digits == 8 && i > 0 && i % 2 == 0)
+        {
+            frame->header[n++] = ' ';
+        }
+        frame->header[n++] = digits[i];
+    }
+    frame->header[n] = '\0';
+
+    frame->byte_count = data_digits / 2;
+    for (int i = 0; i < frame->byte_count; i++)
+    {
+        frame->bytes[i] = elmcfg_hex_value(digits[header_digits + 2 * i]) << 4
+                          | elmcfg_hex_value(digits[header_digits + 2 * i + 1]);
+    }
+    return true;
+}
+
+static message_t *find_message(const char *header)
+{
+    for (int i = 0; i < MAX_MESSAGES; i++)
+    {
+        if (ctx.messages[i].used && strcmp(ctx.messages[i].header, header) == 0)
+        {
+            return &ctx.messages[i];
+        }
+    }
+    return NULL;
+}
+
+static message_t *new_message(const char *header)
+{
+    message_t *message = find_message(header);
+    for (int i = 0; message == NULL && i < MAX_MESSAGES; i++)
+    {
+        if (!ctx.messages[i].used)
+        {
+            message = &ctx.messages[i];
+        }
+    }
+    if (message != NULL)
+    {
+        memset(message, 0, sizeof(*message));
+        message->used = true;
+        strcpy(message->header, header);
+    }
+    return message;
+}
+
+static void append_payload(message_t *message, const uint8_t *bytes, int count)
+{
+    int room = message->length - message->received;
+    if (count > room)
+    {
+        // Padding after the last byte
+        count = room;
+    }
+    memcpy(message->payload + message->received, bytes, count);
+    message->received += count;
+}
+
+void isotp_reset(void)
+{
+    for (int i = 0; i < MAX_MESSAGES; i++)
+    {
+        ctx.messages[i].used = false;
+    }
+}
+
+bool isotp_on_line(const char *line, uint16_t length)
+{
+    frame_t frame;
+    if (!parse_frame(line, length, &frame))
+    {
+        return false;
+    }
+
+    uint8_t pci = frame.bytes[0] >> 4;
+    message_t *message;
+    switch (pci)
+    {
+    case PCI_FIRST:
+        if (frame.byte_count < 2)
+        {
+            return false;
+        }
+        uint16_t total = (frame.bytes[0] & 0x0F) << 8 | frame.bytes[1];
+        if (total > MAX_PAYLOAD)
+        {
+            // Passed through unchanged, so are its consecutive frames
+            return false;
+        }
+        message = new_message(frame.header);
+        if (message == NULL)
+        {
+            return false;
+        }
+        message->spaces = frame.spaces;
+        message->length = total;
+        message->next_seq = 1;
+        append_payload(message, frame.bytes + 2, frame.byte_count - 2);
+        return true;
+
+    case PCI_CONSECUTIVE:
+        message = find_message(frame.header);
+        if (message == NULL)
+        {
+            return false;
+        }
+        if ((frame.bytes[0] & 0x0F) != message->next_seq)
+        {
+            ESP_LOGW(TAG, "%s: sequence %d, expected %d",
+                     message->header,
+                     frame.bytes[0] & 0x0F,
+                     message->next_seq);
+            message->broken = true;
+        }
+        message->next_seq = (message->next_seq + 1) & 0x0F;
+        if (!message->broken)
+        {
+            append_payload(message, frame.bytes + 1, frame.byte_count - 1);
+        }
+        return true;
+
+    case PCI_SINGLE:
+    default:
+        return false;
+    }
+}
+
+static int compare_messages(const void *a, const void *b)
+{
+    const message_t *const *ma = a;
+    const message_t *const *mb = b;
+    return strcmp((*ma)->header, (*mb)->header);
+}
+
+static uint16_t format_message(const message_t *message)
+{
+    const char *sep = message->spaces ? " " : "";
+    int n = snprintf(ctx.emit_buffer, sizeof(ctx.emit_buffer), "%s%s%X%s%02X",
+                     message->header,
+                     sep,
+                     PCI_FIRST << 4 | message->length >> 8,
+                     sep,
+                     message->length & 0xFF);
+    for (uint16_t i = 0; i < message->received; i++)
+    {
+        n += snprintf(ctx.emit_buffer + n, sizeof(ctx.emit_buffer) - n, "%s%02X",
+                      sep,
+                      message->payload[i]);
+    }
+    ctx.emit_buffer[n++] = '\r';
+    return n;
+}
+
+void isotp_flush(isotp_emit_t emit)
+{
+    // Replies from several ECUs interleave in arrival order, which varies
+    // from request to request
+    const message_t *sorted[MAX_MESSAGES];
+    int count = 0;
+    for (int i = 0; i < MAX_MESSAGES; i++)
+    {
+        if (ctx.messages[i].used)
+        {
+            sorted[count++] = &ctx.messages[i];
+        }
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_messages);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (sorted[i]->broken || sorted[i]->received < sorted[i]->length)
+        {
+            ESP_LOGW(TAG, "%s: incomplete, %d of %d bytes",
+                     sorted[i]->header,
+                     sorted[i]->received,
+                     sorted[i]->length);
+            ctx.incomplete++;
+        }
+        else
+        {
+            ctx.complete++;
+        }
+        // Incomplete messages are still emitted with the length from the
+        // first frame, so the client sees the shortfall
+        emit(ctx.emit_buffer, format_message(sorted[i]));
+    }
+    isotp_reset();
+}
+
+void isotp_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "isotp=%"PRIu32"/%"PRIu32"\n", ctx.complete, ctx.incomplete);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
+
+typedef void (*isotp_emit_t)(const char *line, uint16_t length);
+
+void isotp_reset(void);
+bool isotp_on_line(const char *line, uint16_t length);
+void isotp_flush(isotp_emit_t emit);
+void isotp_write_stats(stats_writer_t *writer);
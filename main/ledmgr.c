@@ -3,7 +3,9 @@
 #include <stdbool.h>
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <esp_log.h>
+#include <esp_attr.h>
 #include <driver/gpio.h>
 #include <driver/ledc.h>
 
@@ -12,8 +14,12 @@
 #define LEDC_MODE       LEDC_LOW_SPEED_MODE
 #define LEDC_CHANNEL    LEDC_CHANNEL_0
 #define LEDC_TIMER      LEDC_TIMER_0
+#define LEDC_BLINK_TIMER LEDC_TIMER_1
 #define LEDC_BRIGHTNESS 128
 #define LEDC_BREATHING_BRIGHTNESS 24
+#define LEDC_BREATHING_HALF_PERIOD_MS 1200
+#define ACTIVITY_HOLD_TIME pdMS_TO_TICKS(100)
+#define WAKEUP_WINDOW_TIME pdMS_TO_TICKS(60000)
 
 static const ledc_timer_config_t LEDC_TIMER_CONFIG = {
     .speed_mode = LEDC_MODE,
@@ -22,6 +28,17 @@ static const ledc_timer_config_t LEDC_TIMER_CONFIG = {
     .freq_hz = 1000,
 };
 
+// Activity blinking is generated by the LEDC peripheral, the channel is
+// switched to this 10 Hz timer at 50% duty while there is traffic
+static const ledc_timer_config_t LEDC_BLINK_TIMER_CONFIG = {
+    .speed_mode = LEDC_MODE,
+    .duty_resolution = LEDC_TIMER_10_BIT,
+    .timer_num = LEDC_BLINK_TIMER,
+    .freq_hz = 10,
+    .clk_cfg = LEDC_USE_REF_TICK,
+};
+#define LEDC_BLINK_DUTY 512
+
 static const ledc_channel_config_t LEDC_CHANNEL_CONFIG = {
     .gpio_num = LEDC_GPIO,
     .speed_mode = LEDC_MODE,
@@ -45,105 +62,179 @@ typedef enum
     LEDMGR_STATE_PANIC,
 } ledmgr_state_t;
 
+// Logging is the deepest call, measured high-water mark ~1 KB
+#define TASK_STACK_SIZE 2560
+
 static struct
 {
-    QueueHandle_t msg_queue;
-    TickType_t queue_wait_time;
+    TaskHandle_t task;
+    StaticTask_t task_buffer;
+    StackType_t task_stack[TASK_STACK_SIZE];
+
+    // Written by the callers and sampled by the LED task, so that callers
+    // never block on the LED task
+    volatile ledmgr_state_t requested_state;
+    volatile TickType_t activity_timestamp;
+    volatile bool activity_pending;
+    volatile panic_id_t panic_id;
+
+    // Set by the fade end interrupt
+    volatile bool fade_done;
+
     ledmgr_state_t state;
-    ledmgr_state_t prev_state;
+    TickType_t step_time;
+    TickType_t step_period;
     uint32_t led_level;
+    bool blinking;
+    bool breath_rising;
 
-    int connecting_breath_seq;
-
-    volatile TickType_t activity_timestamp;
+    uint32_t wakeups;
+    TickType_t wakeup_window_start;
+    uint32_t wakeups_per_minute;
 
-    panic_id_t panic_id;
     bool panic_blink_paused;
     int panic_blink_bit_index;
 } ctx;
 
 _Static_assert(sizeof(TickType_t) == 4, "sizeof(TickType_t) == 4 required for atomicity");
 
+static void stop_effects(void)
+{
+    ledc_fade_stop(LEDC_MODE, LEDC_CHANNEL);
+    if (ctx.blinking)
+    {
+        ledc_bind_channel_timer(LEDC_MODE, LEDC_CHANNEL, LEDC_TIMER);
+        ctx.blinking = false;
+    }
+}
+
 static void set_led_level(uint32_t level)
 {
-    ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, level);
-    ledc_update_duty(LEDC_MODE, LEDC_CHANNEL);
+    stop_effects();
+    ledc_set_duty_and_update(LEDC_MODE, LEDC_CHANNEL, level, 0);
     ctx.led_level = level;
 }
 
-static void toggle_led_level(void)
+static void fade_led_level(uint32_t level, int time_ms)
 {
-    set_led_level(ctx.led_level > 0 ? 0 : LEDC_BRIGHTNESS);
+    ctx.fade_done = false;
+    ledc_set_fade_with_time(LEDC_MODE, LEDC_CHANNEL, level, time_ms);
+    ledc_fade_start(LEDC_MODE, LEDC_CHANNEL, LEDC_FADE_NO_WAIT);
+    ctx.led_level = level;
 }
 
-static bool try_change_state(ledmgr_state_t new_state, TickType_t waited_time)
+static void start_blinking(void)
 {
-    bool allow_state_change = ctx.state != new_state
-                           && ctx.state != LEDMGR_STATE_PANIC;
-    if (allow_state_change)
+    ledc_fade_stop(LEDC_MODE, LEDC_CHANNEL);
+    ledc_bind_channel_timer(LEDC_MODE, LEDC_CHANNEL, LEDC_BLINK_TIMER);
+    ledc_set_duty_and_update(LEDC_MODE, LEDC_CHANNEL, LEDC_BLINK_DUTY, 0);
+    ctx.blinking = true;
+}
+
+static bool IRAM_ATTR on_fade_end(const ledc_cb_param_t *param, void *user_arg)
+{
+    BaseType_t task_woken = pdFALSE;
+    if (param->event == LEDC_FADE_END_EVT)
     {
-        ctx.prev_state = ctx.state;
-        ctx.state = new_state;
-        return true;
+        ctx.fade_done = true;
+        vTaskNotifyGiveFromISR(ctx.task, &task_woken);
+    }
+    return task_woken == pdTRUE;
+}
+
+static void request_state(ledmgr_state_t new_state)
+{
+    if (ctx.requested_state == LEDMGR_STATE_PANIC)
+    {
+        return;
+    }
+    ctx.requested_state = new_state;
+    if (ctx.task != NULL)
+    {
+        xTaskNotifyGive(ctx.task);
+    }
+}
+
+static bool is_activity_recent(void)
+{
+    return xTaskGetTickCount() - ctx.activity_timestamp <= ACTIVITY_HOLD_TIME;
+}
+
+static ledmgr_state_t next_state(void)
+{
+    ledmgr_state_t requested = ctx.requested_state;
+    if (requested == LEDMGR_STATE_PANIC)
+    {
+        return requested;
     }
 
-    if (ctx.queue_wait_time != portMAX_DELAY)
+    if (ctx.activity_pending)
     {
-        if (waited_time < ctx.queue_wait_time)
+        if (is_activity_recent())
         {
-            ctx.queue_wait_time -= waited_time;
+            return LEDMGR_STATE_ACTIVITY;
         }
-        else
+
+        // Clear before checking again, so that activity reported in between
+        // either shows up here or notifies the task again
+        ctx.activity_pending = false;
+        if (is_activity_recent())
         {
-            ctx.queue_wait_time = 0;
+            ctx.activity_pending = true;
+            return LEDMGR_STATE_ACTIVITY;
         }
     }
-    return false;
+    return requested;
 }
 
 static void handle_disconnected(void)
 {
-    ctx.queue_wait_time = portMAX_DELAY;
+    ctx.step_period = portMAX_DELAY;
     set_led_level(0);
 }
 
 static void handle_spp_connecting(bool state_changed)
 {
-    ctx.queue_wait_time = pdMS_TO_TICKS(50);
+    // The fade engine steps the brightness, the task only wakes to
+    // reverse direction at the end of each half breath
+    ctx.step_period = portMAX_DELAY;
 
     if (state_changed)
     {
-        ctx.connecting_breath_seq = 0;
+        set_led_level(0);
+        ctx.breath_rising = true;
+    }
+    else if (ctx.fade_done)
+    {
+        ctx.breath_rising = !ctx.breath_rising;
+    }
+    else
+    {
+        return;
     }
 
-    uint32_t level = ctx.connecting_breath_seq < LEDC_BREATHING_BRIGHTNESS
-        ? ctx.connecting_breath_seq
-        : (2 * LEDC_BREATHING_BRIGHTNESS - ctx.connecting_breath_seq - 1);
-    set_led_level(level);
-    ctx.connecting_breath_seq = (ctx.connecting_breath_seq + 1) % (LEDC_BREATHING_BRIGHTNESS * 2);
+    fade_led_level(ctx.breath_rising ? LEDC_BREATHING_BRIGHTNESS : 0,
+                   LEDC_BREATHING_HALF_PERIOD_MS);
 }
 
 static void handle_connected(void)
 {
-    ctx.queue_wait_time = portMAX_DELAY;
+    ctx.step_period = portMAX_DELAY;
     set_led_level(LEDC_BRIGHTNESS);
 }
 
 static void handle_activity(bool state_changed)
 {
-    ctx.queue_wait_time = pdMS_TO_TICKS(50);
     if (state_changed)
     {
-        set_led_level(0);
-    }
-    else if (xTaskGetTickCount() - ctx.activity_timestamp > pdMS_TO_TICKS(100))
-    {
-        xQueueSend(ctx.msg_queue, &ctx.prev_state, portMAX_DELAY);
-    }
-    else
-    {
-        toggle_led_level();
+        start_blinking();
     }
+
+    // Sleep until the last activity is older than the hold time
+    TickType_t since_activity = xTaskGetTickCount() - ctx.activity_timestamp;
+    ctx.step_period = since_activity <= ACTIVITY_HOLD_TIME
+        ? ACTIVITY_HOLD_TIME - since_activity + 1
+        : 1;
 }
 
 static void handle_panic(bool state_changed)
@@ -163,11 +254,11 @@ static void handle_panic(bool state_changed)
         {
             ctx.panic_blink_paused = true;
             ctx.panic_blink_bit_index = 0;
-            ctx.queue_wait_time = pdMS_TO_TICKS(3000);
+            ctx.step_period = pdMS_TO_TICKS(3000);
         }
         else
         {
-            ctx.queue_wait_time = pdMS_TO_TICKS(250);
+            ctx.step_period = pdMS_TO_TICKS(250);
         }
     }
     else
@@ -175,26 +266,47 @@ static void handle_panic(bool state_changed)
         ctx.panic_blink_paused = false;
         set_led_level(LEDC_BRIGHTNESS);
         bool long_blink = (ctx.panic_id >> ctx.panic_blink_bit_index) & 1;
-        ctx.queue_wait_time = pdMS_TO_TICKS(long_blink ? 500 : 250);
+        ctx.step_period = pdMS_TO_TICKS(long_blink ? 500 : 250);
+    }
+}
+
+static void count_wakeup(TickType_t now)
+{
+    ctx.wakeups++;
+    TickType_t elapsed = now - ctx.wakeup_window_start;
+    if (elapsed >= WAKEUP_WINDOW_TIME)
+    {
+        ctx.wakeups_per_minute = (uint64_t)ctx.wakeups * WAKEUP_WINDOW_TIME / elapsed;
+        ctx.wakeups = 0;
+        ctx.wakeup_window_start = now;
+        ESP_LOGI(TAG, "LED task wakeups per minute: %"PRIu32, ctx.wakeups_per_minute);
     }
 }
 
 static void ledmgr_thread(void *arg)
 {
+    TickType_t wait_time = portMAX_DELAY;
     while (1)
     {
-        ledmgr_state_t new_state;
-        TickType_t wait_begin_time = xTaskGetTickCount();
-        bool state_changed = xQueueReceive(ctx.msg_queue,
-                                           &new_state,
-                                           ctx.queue_wait_time) == pdPASS;
-        TickType_t waited_time = xTaskGetTickCount() - wait_begin_time;
-
-        if (state_changed && !try_change_state(new_state, waited_time))
+        ulTaskNotifyTake(pdTRUE, wait_time);
+
+        TickType_t now = xTaskGetTickCount();
+        count_wakeup(now);
+
+        ledmgr_state_t new_state = next_state();
+        bool state_changed = new_state != ctx.state;
+        TickType_t elapsed = now - ctx.step_time;
+
+        // Woken by a notification that did not change what is shown
+        if (!state_changed
+            && ctx.step_period != portMAX_DELAY
+            && elapsed < ctx.step_period)
         {
+            wait_time = ctx.step_period - elapsed;
             continue;
         }
 
+        ctx.state = new_state;
         switch (ctx.state)
         {
         case LEDMGR_STATE_DISCONNECTED:
@@ -213,15 +325,17 @@ static void ledmgr_thread(void *arg)
             handle_panic(state_changed);
             break;
         }
+        ctx.step_time = now;
+        wait_time = ctx.step_period;
     }
 }
 
 void ledmgr_init(void)
 {
     esp_err_t err;
-    
-    ctx.queue_wait_time = portMAX_DELAY;
-    
+
+    ctx.step_period = portMAX_DELAY;
+
     err = ledc_timer_config(&LEDC_TIMER_CONFIG);
     if (err)
     {
@@ -229,6 +343,13 @@ void ledmgr_init(void)
         panic(PANIC_ID_LEDMGR_LEDC_TIMER_CONFIG_FAILED);
     }
 
+    err = ledc_timer_config(&LEDC_BLINK_TIMER_CONFIG);
+    if (err)
+    {
+        ESP_LOGE(TAG, "ledc_timer_config failed: %d", err);
+        panic(PANIC_ID_LEDMGR_LEDC_BLINK_TIMER_CONFIG_FAILED);
+    }
+
     err = ledc_channel_config(&LEDC_CHANNEL_CONFIG);
     if (err)
     {
@@ -236,56 +357,80 @@ void ledmgr_init(void)
         panic(PANIC_ID_LEDMGR_LEDC_CHANNEL_CONFIG_FAILED);
     }
 
-    set_led_level(0);
+    err = ledc_fade_func_install(0);
+    if (err)
+    {
+        ESP_LOGE(TAG, "ledc_fade_func_install failed: %d", err);
+        panic(PANIC_ID_LEDMGR_LEDC_FADE_INSTALL_FAILED);
+    }
 
-    ctx.msg_queue = xQueueCreate(64, sizeof(ledmgr_state_t));
-    if (ctx.msg_queue == NULL)
+    ledc_cbs_t cbs = {
+        .fade_cb = on_fade_end,
+    };
+    err = ledc_cb_register(LEDC_MODE, LEDC_CHANNEL, &cbs, NULL);
+    if (err)
     {
-        ESP_LOGE(TAG, "xQueueCreate failed");
-        panic(PANIC_ID_LEDMGR_CREATE_QUEUE_FAILED);
+        ESP_LOGE(TAG, "ledc_cb_register failed: %d", err);
+        panic(PANIC_ID_LEDMGR_LEDC_FADE_INSTALL_FAILED);
     }
 
-    BaseType_t ret = xTaskCreate(ledmgr_thread,
-                                 TAG,
-                                 4096,
-                                 NULL,
-                                 5,
-                                 NULL);
-    if (ret != pdPASS)
+    set_led_level(0);
+
+    ctx.task = xTaskCreateStaticPinnedToCore(ledmgr_thread,
+                                             TAG,
+                                             TASK_STACK_SIZE,
+                                             NULL,
+                                             CONFIG_VLINK_LED_TASK_PRIORITY,
+                                             ctx.task_stack,
+                                             &ctx.task_buffer,
+                                             CONFIG_VLINK_LED_TASK_CORE);
+    if (ctx.task == NULL)
     {
-        ESP_LOGE(TAG, "xTaskCreate failed: %d", (int)ret);
+        ESP_LOGE(TAG, "xTaskCreateStaticPinnedToCore failed");
         panic(PANIC_ID_LEDMGR_TASK_CREATE_FAILED);
     }
 }
 
 void ledmgr_on_disconnected(void)
 {
-    ledmgr_state_t new_state = LEDMGR_STATE_DISCONNECTED;
-    xQueueSend(ctx.msg_queue, &new_state, portMAX_DELAY);
+    request_state(LEDMGR_STATE_DISCONNECTED);
 }
 
 void ledmgr_on_connecting(void)
 {
-    ledmgr_state_t new_state = LEDMGR_STATE_SPP_CONNECTING;
-    xQueueSend(ctx.msg_queue, &new_state, portMAX_DELAY);
+    request_state(LEDMGR_STATE_SPP_CONNECTING);
 }
 
 void ledmgr_on_connected(void)
 {
-    ledmgr_state_t new_state = LEDMGR_STATE_CONNECTED;
-    xQueueSend(ctx.msg_queue, &new_state, portMAX_DELAY);
+    request_state(LEDMGR_STATE_CONNECTED);
 }
 
 void ledmgr_on_activity(void)
 {
+    // Bursts of packets only notify the LED task once, it samples the
+    // timestamp to decide when the activity blinking ends
     ctx.activity_timestamp = xTaskGetTickCount();
-    ledmgr_state_t new_state = LEDMGR_STATE_ACTIVITY;
-    xQueueSend(ctx.msg_queue, &new_state, portMAX_DELAY);
+    if (!ctx.activity_pending && ctx.task != NULL)
+    {
+        ctx.activity_pending = true;
+        xTaskNotifyGive(ctx.task);
+    }
+}
+
+uint32_t ledmgr_get_wakeups_per_minute(void)
+{
+    // Without wakeups the window is never closed by the LED task
+    TickType_t elapsed = xTaskGetTickCount() - ctx.wakeup_window_start;
+    if (elapsed >= 2 * WAKEUP_WINDOW_TIME)
+    {
+        return (uint64_t)ctx.wakeups * WAKEUP_WINDOW_TIME / elapsed;
+    }
+    return ctx.wakeups_per_minute;
 }
 
 void ledmgr_on_panic(panic_id_t id)
 {
     ctx.panic_id = id;
-    ledmgr_state_t new_state = LEDMGR_STATE_PANIC;
-    xQueueSend(ctx.msg_queue, &new_state, portMAX_DELAY);
+    request_state(LEDMGR_STATE_PANIC);
 }
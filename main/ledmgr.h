@@ -7,3 +7,4 @@ void ledmgr_on_connecting(void);
 void ledmgr_on_connected(void);
 void ledmgr_on_activity(void);
 void ledmgr_on_panic(panic_id_t id);
+uint32_t ledmgr_get_wakeups_per_minute(void);
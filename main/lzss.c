@@ -0,0 +1,266 @@
+#include "lzss.h"
+
+#include <string.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "LZSS"
+
+#define WINDOW_SIZE 1024
+#define MIN_MATCH   3
+#define MAX_MATCH   (MIN_MATCH + 63)
+#define HASH_BITS   9
+#define HASH_SIZE   (1 << HASH_BITS)
+// Candidates tried per position, bounds the time per block
+#define MAX_CHAIN   16
+#define BUFFER_LEN  (WINDOW_SIZE + LZSS_UNIT_MAX)
+
+static struct
+{
+    // The window, followed by the data being compressed
+    uint8_t buffer[BUFFER_LEN];
+    uint16_t window_len;
+    // Newest position per hash of three bytes, and the one before it
+    int16_t head[HASH_SIZE];
+    int16_t prev[BUFFER_LEN];
+
+    uint32_t blocks;
+    uint32_t in_bytes;
+    uint32_t out_bytes;
+    uint64_t total_us;
+    uint32_t max_us;
+
+#if CONFIG_VLINK_BLE_COMPRESS_VERIFY
+    // Each block decoded again before it is sent
+    uint8_t check[LZSS_UNIT_MAX];
+    uint32_t verify_failures;
+#endif
+} ctx;
+
+static void slide(uint16_t length)
+{
+    if (length > WINDOW_SIZE)
+    {
+        memmove(ctx.buffer, ctx.buffer + length - WINDOW_SIZE, WINDOW_SIZE);
+        length = WINDOW_SIZE;
+    }
+    ctx.window_len = length;
+}
+
+static int hash(int pos)
+{
+    return (ctx.buffer[pos] << 5 ^ ctx.buffer[pos + 1] << 2 ^ ctx.buffer[pos + 2]) & (HASH_SIZE - 1);
+}
+
+static void insert(int pos, int end)
+{
+    if (pos + MIN_MATCH <= end)
+    {
+        int h = hash(pos);
+        ctx.prev[pos] = ctx.head[h];
+        ctx.head[h] = pos;
+    }
+}
+
+#if CONFIG_VLINK_BLE_COMPRESS_VERIFY
+// Decodes a block the way the client does and compares it with the data
+// at the end of the buffer
+static bool verify(const uint8_t *out, uint16_t n, int length)
+{
+    int i = 0;
+    int pos = 0;
+    int bit = 8;
+    uint8_t flags = 0;
+    while (pos < length)
+    {
+        if (bit == 8)
+        {
+            if (i >= n)
+            {
+                return false;
+            }
+            flags = out[i++];
+            bit = 0;
+        }
+
+        if (flags & 1 << bit)
+        {
+            if (i >= n)
+            {
+                return false;
+            }
+            ctx.check[pos++] = out[i++];
+        }
+        else
+        {
+            if (i + 2 > n)
+            {
+                return false;
+            }
+            uint16_t token = out[i] | out[i + 1] << 8;
+            i += 2;
+            int dist = (token >> 6) + 1;
+            int len = (token & 0x3F) + MIN_MATCH;
+            if (dist > ctx.window_len + pos || pos + len > length)
+            {
+                return false;
+            }
+            for (int k = 0; k < len; k++, pos++)
+            {
+                int from = pos - dist;
+                ctx.check[pos] = from >= 0 ? ctx.check[from] : ctx.buffer[ctx.window_len + from];
+            }
+        }
+        bit++;
+    }
+    return i == n && memcmp(ctx.check, ctx.buffer + ctx.window_len, length) == 0;
+}
+
+// Literals only, always decodes
+static uint16_t store_literals(int length, uint8_t *out)
+{
+    uint16_t n = 0;
+    for (int i = 0; i < length; i++)
+    {
+        if (i % 8 == 0)
+        {
+            out[n++] = 0xFF;
+        }
+        out[n++] = ctx.buffer[ctx.window_len + i];
+    }
+    return n;
+}
+#endif
+
+void lzss_reset(void)
+{
+    ctx.window_len = 0;
+}
+
+void lzss_append(const uint8_t *data, uint16_t length)
+{
+    while (length > 0)
+    {
+        uint16_t chunk = length < LZSS_UNIT_MAX ? length : LZSS_UNIT_MAX;
+        memcpy(ctx.buffer + ctx.window_len, data, chunk);
+        slide(ctx.window_len + chunk);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+uint16_t lzss_compress(const uint8_t *data, uint16_t length, uint8_t *out)
+{
+    int64_t start = esp_timer_get_time();
+    memcpy(ctx.buffer + ctx.window_len, data, length);
+    int end = ctx.window_len + length;
+
+    // Rebuilt per call, the positions move as the window slides
+    memset(ctx.head, 0xFF, sizeof(ctx.head));
+    for (int i = 0; i < ctx.window_len; i++)
+    {
+        insert(i, end);
+    }
+
+    uint16_t n = 0;
+    uint8_t *flags = NULL;
+    int bit = 8;
+    int pos = ctx.window_len;
+    while (pos < end)
+    {
+        if (bit == 8)
+        {
+            flags = &out[n++];
+            *flags = 0;
+            bit = 0;
+        }
+
+        int best_len = 0;
+        int best_dist = 0;
+        int max_len = end - pos < MAX_MATCH ? end - pos : MAX_MATCH;
+        if (max_len >= MIN_MATCH)
+        {
+            int candidate = ctx.head[hash(pos)];
+            for (int chain = 0; candidate >= 0 && chain < MAX_CHAIN; chain++)
+            {
+                if (pos - candidate > WINDOW_SIZE)
+                {
+                    break;
+                }
+                int len = 0;
+                while (len < max_len && ctx.buffer[candidate + len] == ctx.buffer[pos + len])
+                {
+                    len++;
+                }
+                if (len > best_len)
+                {
+                    best_len = len;
+                    best_dist = pos - candidate;
+                    if (len == max_len)
+                    {
+                        break;
+                    }
+                }
+                candidate = ctx.prev[candidate];
+            }
+        }
+
+        if (best_len >= MIN_MATCH)
+        {
+            uint16_t token = (best_dist - 1) << 6 | (best_len - MIN_MATCH);
+            out[n++] = token;
+            out[n++] = token >> 8;
+            for (int i = 0; i < best_len; i++)
+            {
+                insert(pos + i, end);
+            }
+            pos += best_len;
+        }
+        else
+        {
+            *flags |= 1 << bit;
+            out[n++] = ctx.buffer[pos];
+            insert(pos, end);
+            pos++;
+        }
+        bit++;
+    }
+#if CONFIG_VLINK_BLE_COMPRESS_VERIFY
+    if (!verify(out, n, length))
+    {
+        ESP_LOGE(TAG, "Block of %d bytes does not decode, sent as literals", length);
+        ctx.verify_failures++;
+        n = store_literals(length, out);
+    }
+#endif
+    slide(end);
+
+    uint32_t us = esp_timer_get_time() - start;
+    ctx.blocks++;
+    ctx.in_bytes += length;
+    ctx.out_bytes += n;
+    ctx.total_us += us;
+    if (us > ctx.max_us)
+    {
+        ctx.max_us = us;
+    }
+    ESP_LOGD(TAG, "%d -> %d bytes in %"PRIu32" us", length, n, us);
+    return n;
+}
+
+void lzss_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "lzss=blocks:%"PRIu32" in:%"PRIu32"B out:%"PRIu32"B ratio:%"PRIu32"%% us:%"PRIu32"/%"PRIu32,
+                 ctx.blocks,
+                 ctx.in_bytes,
+                 ctx.out_bytes,
+                 ctx.in_bytes > 0 ? (uint32_t)((uint64_t)ctx.out_bytes * 100 / ctx.in_bytes) : 0,
+                 ctx.blocks > 0 ? (uint32_t)(ctx.total_us / ctx.blocks) : 0,
+                 ctx.max_us);
+#if CONFIG_VLINK_BLE_COMPRESS_VERIFY
+    stats_printf(writer, " bad:%"PRIu32, ctx.verify_failures);
+#endif
+    stats_printf(writer, "\n");
+}
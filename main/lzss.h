@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+#include "stats.h"
+
+// Longest input to one lzss_compress() call
+#define LZSS_UNIT_MAX         512
+// Worst case output, one flag byte per eight literals
+#define LZSS_OUT_MAX(length)  ((length) + ((length) + 7) / 8)
+
+// Items follow a flag byte, one bit each starting with the lowest: 1 for
+// a literal byte, 0 for a 16-bit little endian match holding the
+// distance minus 1 in the upper 10 bits and the length minus 3 in the
+// lower 6. Matches reach back into everything sent before, compressed or
+// not, up to 1024 bytes.
+void lzss_reset(void);
+// Data sent as it is still goes into the window
+void lzss_append(const uint8_t *data, uint16_t length);
+uint16_t lzss_compress(const uint8_t *data, uint16_t length, uint8_t *out);
+void lzss_write_stats(stats_writer_t *writer);
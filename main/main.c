@@ -8,7 +8,15 @@
 #include "ledmgr.h"
 #include "gattcomm.h"
 #include "sppcomm.h"
+#include "pwrmgr.h"
+#include "bootprof.h"
+#include "bufpool.h"
+#include "stats.h"
+#include "coex.h"
+#include "datalog.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <nvs.h>
 #include <nvs_flash.h>
 #include <esp_log.h>
@@ -17,13 +25,9 @@
 
 #define TAG "MAIN"
 
-void app_main(void)
+static void nvs_init_task(void *arg)
 {
-    esp_err_t err;
-
-    ledmgr_init();
-
-    err = nvs_flash_init();
+    esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
         err = nvs_flash_erase();
@@ -45,7 +49,45 @@ void app_main(void)
         panic(PANIC_ID_MAIN_NVS_FLASH_INIT_FAILED2);
     }
 
+    bootprof_mark(BOOT_PHASE_NVS_READY);
+    xTaskNotifyGive((TaskHandle_t)arg);
+    vTaskDelete(NULL);
+}
+
+#define NVS_INIT_TASK_STACK_SIZE 3072
+
+static StaticTask_t nvs_init_task_buffer;
+static StackType_t nvs_init_task_stack[NVS_INIT_TASK_STACK_SIZE];
+
+void app_main(void)
+{
+    esp_err_t err;
+
+    bootprof_mark(BOOT_PHASE_APP_MAIN);
+
+    // Mounting NVS scans the flash pages, overlap it with the steps that
+    // do not need it. The controller needs it for the PHY calibration data
+    // when it is enabled.
+    if (xTaskCreateStatic(nvs_init_task,
+                          "nvs_init",
+                          NVS_INIT_TASK_STACK_SIZE,
+                          xTaskGetCurrentTaskHandle(),
+                          5,
+                          nvs_init_task_stack,
+                          &nvs_init_task_buffer) == NULL)
+    {
+        ESP_LOGE(TAG, "xTaskCreateStatic failed");
+        panic(PANIC_ID_MAIN_NVS_TASK_CREATE_FAILED);
+    }
+
+    bufpool_init();
+    stats_init();
+    ledmgr_init();
+    app_init();
+    pwrmgr_init();
+
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+    coex_configure_controller(&bt_cfg);
     err = esp_bt_controller_init(&bt_cfg);
     if (err)
     {
@@ -53,12 +95,15 @@ void app_main(void)
         panic(PANIC_ID_MAIN_BT_CONTROLLER_INIT_FAILED);
     }
 
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
     err = esp_bt_controller_enable(ESP_BT_MODE_BTDM);
     if (err)
     {
         ESP_LOGE(TAG, "esp_bt_controller_enable failed: %d", err);
         panic(PANIC_ID_MAIN_BT_CONTROLLER_ENABLE_FAILED);
     }
+    bootprof_mark(BOOT_PHASE_CONTROLLER_ENABLED);
 
     err = esp_bluedroid_init();
     if (err)
@@ -73,7 +118,15 @@ void app_main(void)
         ESP_LOGE(TAG, "esp_bluedroid_enable failed: %d", err);
         panic(PANIC_ID_MAIN_BLUEDROID_ENABLE_FAILED);
     }
+    bootprof_mark(BOOT_PHASE_BLUEDROID_ENABLED);
 
+    // Both only queue requests to the Bluetooth stack, the GATT and SPP
+    // registration chains then proceed concurrently. GATT goes first as
+    // it gates advertising.
     gattcomm_init();
     sppcomm_init();
+#if CONFIG_VLINK_DATALOG
+    // Scans the log partition while the registrations run
+    datalog_init();
+#endif
 }
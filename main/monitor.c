@@ -0,0 +1,350 @@
+#include "monitor.h"
+#include "gattcomm.h"
+#include "elmcfg.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "MONITOR"
+
+#define MAX_IDS        8
+#define MAX_FRAME_LEN  8
+#define STD_ID_DIGITS  3
+#define EXT_ID_DIGITS  8
+#define STD_ID_MASK    0x7FF
+#define EXT_ID_MASK    0x1FFFFFFF
+// "18DAF110" and eight data bytes, longer lines are not frames
+#define LINE_MAX_LEN   (EXT_ID_DIGITS + 2 * MAX_FRAME_LEN)
+// Longest notification payload with a 512 byte MTU
+#define BATCH_MAX_LEN  509
+
+// Record flags byte, followed by a 16-bit millisecond timestamp, the ID
+// (2 bytes, or 4 with MONITOR_FLAG_EXT) and the data, little endian
+#define MONITOR_FLAG_EXT 0x80
+#define MONITOR_LEN_MASK 0x0F
+#define RECORD_MAX_LEN   (1 + 2 + 4 + MAX_FRAME_LEN)
+
+static struct
+{
+    uint32_t ids[MAX_IDS];
+    bool ids_ext[MAX_IDS];
+    int id_count;
+    int setup_step;
+    char setup_cmd[16];
+
+    char line[LINE_MAX_LEN];
+    uint16_t line_len;
+    bool line_overflow;
+
+    uint8_t batch[BATCH_MAX_LEN];
+    uint16_t batch_len;
+    uint16_t batch_records;
+
+    uint32_t frames;
+    uint32_t filtered;
+    uint32_t dropped;
+    uint32_t overruns;
+    uint32_t errors;
+} ctx;
+
+static bool parse_hex(const char *text, int digits, uint32_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < digits; i++)
+    {
+        int nibble = elmcfg_hex_value(text[i]);
+        if (nibble < 0)
+        {
+            return false;
+        }
+        *value = *value << 4 | nibble;
+    }
+    return true;
+}
+
+bool monitor_configure(const char *ids, uint16_t length)
+{
+    ctx.id_count = 0;
+    uint16_t i = 0;
+    while (i < length)
+    {
+        if (ids[i] == ' ' || ids[i] == ',')
+        {
+            i++;
+            continue;
+        }
+
+        uint16_t start = i;
+        while (i < length && elmcfg_hex_value(ids[i]) >= 0)
+        {
+            i++;
+        }
+        int digits = i - start;
+        if ((digits != STD_ID_DIGITS && digits != EXT_ID_DIGITS) || ctx.id_count == MAX_IDS)
+        {
+            ESP_LOGW(TAG, "Bad ID list %.*s", length, ids);
+            ctx.id_count = 0;
+            return false;
+        }
+        parse_hex(ids + start, digits, &ctx.ids[ctx.id_count]);
+        ctx.ids_ext[ctx.id_count] = digits == EXT_ID_DIGITS;
+        ctx.id_count++;
+    }
+
+    ctx.setup_step = 0;
+    ctx.line_len = 0;
+    ctx.line_overflow = false;
+    ctx.batch_len = 0;
+    ctx.batch_records = 0;
+    ESP_LOGI(TAG, "Monitoring %d IDs", ctx.id_count);
+    return true;
+}
+
+// The adapter filters with ATCRA for one ID, or with a filter and mask
+// that lets a few more through for several IDs of the same width
+static const char *filter_cmd(int step)
+{
+    if (ctx.id_count == 0)
+    {
+        return NULL;
+    }
+
+    bool ext = ctx.ids_ext[0];
+    uint32_t differ = 0;
+    for (int i = 1; i < ctx.id_count; i++)
+    {
+        if (ctx.ids_ext[i] != ext)
+        {
+            return NULL;
+        }
+        differ |= ctx.ids[i] ^ ctx.ids[0];
+    }
+    int digits = ext ? EXT_ID_DIGITS : STD_ID_DIGITS;
+
+    if (ctx.id_count == 1)
+    {
+        if (step > 0)
+        {
+            return NULL;
+        }
+        sprintf(ctx.setup_cmd, "ATCRA%0*"PRIX32"\r", digits, ctx.ids[0]);
+        return ctx.setup_cmd;
+    }
+
+    switch (step)
+    {
+    case 0:
+        sprintf(ctx.setup_cmd, "ATCF%0*"PRIX32"\r", digits, ctx.ids[0]);
+        return ctx.setup_cmd;
+    case 1:
+        sprintf(ctx.setup_cmd, "ATCM%0*"PRIX32"\r", digits, ~differ & (ext ? EXT_ID_MASK : STD_ID_MASK));
+        return ctx.setup_cmd;
+    default:
+        return NULL;
+    }
+}
+
+const char *monitor_next_setup_cmd(bool *last)
+{
+    // Headers on, no spaces and raw data bytes, then the filter
+    // The client's settings come back with the ATD at stop
+    static const char *const FORMAT_CMDS[] = { "ATE0\r", "ATH1\r", "ATS0\r", "ATCAF0\r" };
+    const int format_count = sizeof(FORMAT_CMDS) / sizeof(FORMAT_CMDS[0]);
+
+    *last = false;
+    int step = ctx.setup_step++;
+    if (step < format_count)
+    {
+        return FORMAT_CMDS[step];
+    }
+    const char *cmd = filter_cmd(step - format_count);
+    if (cmd != NULL)
+    {
+        return cmd;
+    }
+    // Runs until interrupted, the last step repeats after BUFFER FULL
+    ctx.setup_step--;
+    *last = true;
+    return "ATMA\r";
+}
+
+static bool id_wanted(uint32_t id, bool ext)
+{
+    if (ctx.id_count == 0)
+    {
+        return true;
+    }
+    for (int i = 0; i < ctx.id_count; i++)
+    {
+        if (ctx.ids[i] == id && ctx.ids_ext[i] == ext)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void monitor_flush(void)
+{
+    if (ctx.batch_len == 0)
+    {
+        return;
+    }
+
+    // Dropped rather than queued behind a full link, the bus keeps going
+    if (gattcomm_is_congested())
+    {
+        ctx.dropped += ctx.batch_records;
+    }
+    else
+    {
+        gattcomm_tx(ctx.batch, ctx.batch_len);
+    }
+    ctx.batch_len = 0;
+    ctx.batch_records = 0;
+}
+
+static void add_record(uint32_t id, bool ext, const uint8_t *data, int length)
+{
+    uint16_t max_len = gattcomm_get_tx_size();
+    if (max_len > sizeof(ctx.batch))
+    {
+        max_len = sizeof(ctx.batch);
+    }
+    if (ctx.batch_len + RECORD_MAX_LEN > max_len)
+    {
+        monitor_flush();
+    }
+
+    uint16_t time_ms = esp_timer_get_time() / 1000;
+    uint8_t *record = ctx.batch + ctx.batch_len;
+    int n = 0;
+    record[n++] = (ext ? MONITOR_FLAG_EXT : 0) | length;
+    record[n++] = time_ms;
+    record[n++] = time_ms >> 8;
+    record[n++] = id;
+    record[n++] = id >> 8;
+    if (ext)
+    {
+        record[n++] = id >> 16;
+        record[n++] = id >> 24;
+    }
+    memcpy(record + n, data, length);
+    ctx.batch_len += n + length;
+    ctx.batch_records++;
+}
+
+// Echoes, status and progress lines carry no frame
+static bool is_status_line(const char *line, int length)
+{
+    static const char *const PREFIXES[] = { "AT", "OK", "SEARCHING", "STOPPED" };
+
+    for (size_t i = 0; i < sizeof(PREFIXES) / sizeof(PREFIXES[0]); i++)
+    {
+        int prefix_len = strlen(PREFIXES[i]);
+        if (length >= prefix_len && memcmp(line, PREFIXES[i], prefix_len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void finish_line(void)
+{
+    const char *line = ctx.line;
+    int length = ctx.line_len;
+    bool overflow = ctx.line_overflow;
+    ctx.line_len = 0;
+    ctx.line_overflow = false;
+    if (length == 0)
+    {
+        return;
+    }
+    if (overflow)
+    {
+        ctx.errors++;
+        return;
+    }
+    if (length == 10 && memcmp(line, "BUFFERFULL", 10) == 0)
+    {
+        ctx.overruns++;
+        return;
+    }
+    if (is_status_line(line, length))
+    {
+        return;
+    }
+
+    // 11-bit IDs leave an odd digit count
+    bool ext = length % 2 == 0;
+    int id_digits = ext ? EXT_ID_DIGITS : STD_ID_DIGITS;
+    uint32_t id;
+    if (length < id_digits || !parse_hex(line, id_digits, &id))
+    {
+        ctx.errors++;
+        return;
+    }
+
+    uint8_t data[MAX_FRAME_LEN];
+    int data_len = 0;
+    for (int i = id_digits; i < length; i += 2)
+    {
+        uint32_t byte;
+        if (!parse_hex(line + i, 2, &byte))
+        {
+            ctx.errors++;
+            return;
+        }
+        data[data_len++] = byte;
+    }
+
+    ctx.frames++;
+    if (!id_wanted(id, ext))
+    {
+        ctx.filtered++;
+        return;
+    }
+    add_record(id, ext, data, data_len);
+}
+
+bool monitor_on_rx(const uint8_t *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        switch (c)
+        {
+        case '\r':
+        case '\n':
+        case '>':
+            finish_line();
+            break;
+        case ' ':
+            break;
+        default:
+            if (ctx.line_len == sizeof(ctx.line))
+            {
+                ctx.line_overflow = true;
+                break;
+            }
+            ctx.line[ctx.line_len++] = c;
+            break;
+        }
+    }
+    return ctx.batch_len > 0;
+}
+
+void monitor_write_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "monitor=frames:%"PRIu32" filtered:%"PRIu32" dropped:%"PRIu32" overruns:%"PRIu32" errors:%"PRIu32"\n",
+                 ctx.frames,
+                 ctx.filtered,
+                 ctx.dropped,
+                 ctx.overruns,
+                 ctx.errors);
+}
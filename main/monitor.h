@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
+
+bool monitor_configure(const char *ids, uint16_t length);
+// Sets last when the command starts monitoring
+const char *monitor_next_setup_cmd(bool *last);
+// Returns true while records wait for a full notification
+bool monitor_on_rx(const uint8_t *data, uint16_t length);
+void monitor_flush(void);
+void monitor_write_stats(stats_writer_t *writer);
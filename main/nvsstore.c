@@ -0,0 +1,85 @@
+#include "nvsstore.h"
+
+#include <stdio.h>
+
+#include <esp_log.h>
+#include <nvs.h>
+
+#define TAG "NVSSTORE"
+
+bool nvsstore_load_blob(const char *ns, const char *key, void *data, size_t size)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(ns, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return false;
+    }
+
+    size_t stored_size = size;
+    esp_err_t err = nvs_get_blob(nvs, key, data, &stored_size);
+    nvs_close(nvs);
+    return !err && stored_size == size;
+}
+
+void nvsstore_save_blob(const char *ns, const char *key, const void *data, size_t size)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(ns, NVS_READWRITE, &nvs);
+    if (err)
+    {
+        ESP_LOGW(TAG, "nvs_open failed: %d", err);
+        return;
+    }
+
+    err = nvs_set_blob(nvs, key, data, size);
+    if (!err)
+    {
+        err = nvs_commit(nvs);
+    }
+    if (err)
+    {
+        ESP_LOGW(TAG, "Saving %s/%s failed: %d", ns, key, err);
+    }
+    nvs_close(nvs);
+}
+
+uint32_t nvsstore_load_u32(const char *ns, const char *key)
+{
+    uint32_t value = 0;
+    nvs_handle_t nvs;
+    if (nvs_open(ns, NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return 0;
+    }
+    nvs_get_u32(nvs, key, &value);
+    nvs_close(nvs);
+    return value;
+}
+
+void nvsstore_save_u32(const char *ns, const char *key, uint32_t value)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(ns, NVS_READWRITE, &nvs);
+    if (err)
+    {
+        ESP_LOGW(TAG, "nvs_open failed: %d", err);
+        return;
+    }
+
+    err = nvs_set_u32(nvs, key, value);
+    if (!err)
+    {
+        err = nvs_commit(nvs);
+    }
+    if (err)
+    {
+        ESP_LOGW(TAG, "Saving %s/%s failed: %d", ns, key, err);
+    }
+    nvs_close(nvs);
+}
+
+void nvsstore_make_addr_key(const uint8_t *addr, char *key)
+{
+    snprintf(key, NVSSTORE_ADDR_KEY_LEN, "%02x%02x%02x%02x%02x%02x",
+             addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Twelve hex digits and the terminator
+#define NVSSTORE_ADDR_KEY_LEN 13
+
+// False when the key holds nothing of exactly that size
+bool nvsstore_load_blob(const char *ns, const char *key, void *data, size_t size);
+void nvsstore_save_blob(const char *ns, const char *key, const void *data, size_t size);
+// 0 when the key is not set
+uint32_t nvsstore_load_u32(const char *ns, const char *key);
+void nvsstore_save_u32(const char *ns, const char *key, uint32_t value);
+
+// Key for state kept per OBD adapter, which stays in one vehicle
+void nvsstore_make_addr_key(const uint8_t *addr, char *key);
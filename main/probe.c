@@ -0,0 +1,306 @@
+#include "probe.h"
+#include "app.h"
+#include "gattcomm.h"
+#include "coex.h"
+#include "elmcfg.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "PROBE"
+
+#define MAX_SCRIPT_CMDS   8
+#define SCRIPT_CMD_LEN    16
+#define DEFAULT_SCRIPT    "0100"
+#define SPP_PROBE_CMDS    200
+#define MAX_SAMPLES       256
+#define FLOOD_INTERVAL_MS 5
+// Notifications queued per flood tick while the link is not congested
+#define FLOOD_BURST       4
+#define FLOOD_MAX_LEN     509
+
+static struct
+{
+    probe_mode_t mode;
+    // Results of the last probe, kept after it ends
+    probe_mode_t last_mode;
+    int64_t start_time;
+    int64_t end_time;
+    esp_timer_handle_t flood_timer;
+    uint8_t flood_buffer[FLOOD_MAX_LEN];
+
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t notifications;
+
+    char script[MAX_SCRIPT_CMDS][SCRIPT_CMD_LEN];
+    int script_len;
+    int script_pos;
+    bool stopping;
+    int64_t cmd_start_time;
+    uint32_t cmds;
+    uint32_t timeouts;
+    // Newest latencies, overwritten in a ring once full
+    uint32_t samples_us[MAX_SAMPLES];
+    uint32_t sorted_us[MAX_SAMPLES];
+} ctx;
+
+static void notify(const uint8_t *data, uint16_t length)
+{
+    // Writes longer than the MTU go out as several notifications
+    uint32_t count = gattcomm_get_notify_count();
+    gattcomm_tx(data, length);
+    ctx.tx_bytes += length;
+    ctx.notifications += gattcomm_get_notify_count() - count;
+}
+
+static void on_flood_timer(void *arg)
+{
+    // Sent under the bridge lock like all other client output
+    app_on_probe_flood();
+}
+
+void probe_flood(void)
+{
+    uint16_t length = gattcomm_get_tx_size();
+    if (length > sizeof(ctx.flood_buffer))
+    {
+        length = sizeof(ctx.flood_buffer);
+    }
+    for (int i = 0; i < FLOOD_BURST && ctx.mode == PROBE_MODE_FLOOD && !gattcomm_is_congested(); i++)
+    {
+        ctx.flood_buffer[0] = ctx.notifications;
+        notify(ctx.flood_buffer, length);
+    }
+}
+
+static void begin(probe_mode_t mode)
+{
+    ctx.mode = mode;
+    ctx.last_mode = mode;
+    ctx.start_time = esp_timer_get_time();
+    ctx.end_time = 0;
+    ctx.rx_bytes = 0;
+    ctx.tx_bytes = 0;
+    ctx.notifications = 0;
+    ctx.cmds = 0;
+    ctx.timeouts = 0;
+    ctx.stopping = false;
+}
+
+void probe_end(void)
+{
+    if (ctx.mode == PROBE_MODE_OFF)
+    {
+        return;
+    }
+    if (ctx.flood_timer != NULL)
+    {
+        esp_timer_stop(ctx.flood_timer);
+    }
+    ctx.mode = PROBE_MODE_OFF;
+    ctx.end_time = esp_timer_get_time();
+    ESP_LOGI(TAG, "Probe finished");
+}
+
+bool probe_start_gatt(probe_mode_t mode)
+{
+    if (ctx.mode != PROBE_MODE_OFF)
+    {
+        return false;
+    }
+
+    if (mode == PROBE_MODE_FLOOD)
+    {
+        if (ctx.flood_timer == NULL)
+        {
+            const esp_timer_create_args_t timer_args = {
+                .callback = on_flood_timer,
+                .name = "probe_flood",
+            };
+            esp_err_t err = esp_timer_create(&timer_args, &ctx.flood_timer);
+            if (err)
+            {
+                ESP_LOGW(TAG, "esp_timer_create failed: %d", err);
+                return false;
+            }
+        }
+        for (uint16_t i = 0; i < sizeof(ctx.flood_buffer); i++)
+        {
+            ctx.flood_buffer[i] = i;
+        }
+    }
+
+    begin(mode);
+    if (mode == PROBE_MODE_FLOOD)
+    {
+        esp_timer_start_periodic(ctx.flood_timer, FLOOD_INTERVAL_MS * 1000);
+    }
+    return true;
+}
+
+bool probe_start_spp(const char *cmds, uint16_t length)
+{
+    if (ctx.mode != PROBE_MODE_OFF)
+    {
+        return false;
+    }
+
+    ctx.script_len = elmcfg_parse_cmd_list(cmds, length, &ctx.script[0][0], SCRIPT_CMD_LEN, MAX_SCRIPT_CMDS);
+    if (ctx.script_len < 0)
+    {
+        ESP_LOGW(TAG, "Bad script %.*s", length, cmds);
+        ctx.script_len = 0;
+        return false;
+    }
+    // OBD requests only: AT commands would change the adapter's settings
+    // under the client's session
+    for (int i = 0; i < ctx.script_len; i++)
+    {
+        const char *cmd = ctx.script[i];
+        size_t cmd_len = strlen(cmd) - 1;
+        bool valid = cmd_len >= 2;
+        for (size_t j = 0; j < cmd_len && valid; j++)
+        {
+            valid = elmcfg_hex_value(cmd[j]) >= 0;
+        }
+        if (!valid)
+        {
+            ESP_LOGW(TAG, "Not an OBD request: %.*s", (int)cmd_len, cmd);
+            ctx.script_len = 0;
+            return false;
+        }
+    }
+    if (ctx.script_len == 0)
+    {
+        strcpy(ctx.script[0], DEFAULT_SCRIPT "\r");
+        ctx.script_len = 1;
+    }
+
+    ctx.script_pos = 0;
+    begin(PROBE_MODE_SPP);
+    return true;
+}
+
+void probe_stop(void)
+{
+    if (ctx.mode == PROBE_MODE_SPP)
+    {
+        ctx.stopping = true;
+        return;
+    }
+    probe_end();
+}
+
+probe_mode_t probe_get_mode(void)
+{
+    return ctx.mode;
+}
+
+void probe_on_gatt_rx(const uint8_t *data, uint16_t length)
+{
+    ctx.rx_bytes += length;
+    if (ctx.mode == PROBE_MODE_ECHO)
+    {
+        notify(data, length);
+    }
+}
+
+const char *probe_next_cmd(void)
+{
+    if (ctx.mode != PROBE_MODE_SPP)
+    {
+        return NULL;
+    }
+    if (ctx.stopping || ctx.cmds + ctx.timeouts >= SPP_PROBE_CMDS)
+    {
+        probe_end();
+        return NULL;
+    }
+
+    const char *cmd = ctx.script[ctx.script_pos];
+    ctx.script_pos = (ctx.script_pos + 1) % ctx.script_len;
+    ctx.cmd_start_time = esp_timer_get_time();
+    return cmd;
+}
+
+void probe_on_cmd_done(bool completed)
+{
+    if (!completed)
+    {
+        // The adapter's state is unknown, the probe ends here
+        ctx.timeouts++;
+        ctx.stopping = true;
+        return;
+    }
+    ctx.samples_us[ctx.cmds % MAX_SAMPLES] = esp_timer_get_time() - ctx.cmd_start_time;
+    ctx.cmds++;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(int count, int percent)
+{
+    return ctx.sorted_us[(count - 1) * percent / 100];
+}
+
+void probe_write_stats(stats_writer_t *writer)
+{
+    static const char *const MODE_NAMES[] = { "off", "echo", "sink", "flood", "spp" };
+
+    if (ctx.last_mode == PROBE_MODE_OFF)
+    {
+        return;
+    }
+
+    int64_t end_time = ctx.mode != PROBE_MODE_OFF ? esp_timer_get_time() : ctx.end_time;
+    uint32_t elapsed_ms = (end_time - ctx.start_time) / 1000;
+    if (elapsed_ms == 0)
+    {
+        elapsed_ms = 1;
+    }
+
+    if (ctx.last_mode != PROBE_MODE_SPP)
+    {
+        // Notifications per connection event, in hundredths
+        uint32_t interval_us = coex_get_ble_interval() * 1250;
+        uint32_t fill = (uint64_t)ctx.notifications * interval_us / 10 / elapsed_ms;
+        stats_printf(writer, "probe=%s%s ms:%"PRIu32" rx:%"PRIu32"B/s tx:%"PRIu32"B/s fill:%"PRIu32".%02"PRIu32"\n",
+                     MODE_NAMES[ctx.last_mode],
+                     ctx.mode != PROBE_MODE_OFF ? "*" : "",
+                     elapsed_ms,
+                     (uint32_t)((uint64_t)ctx.rx_bytes * 1000 / elapsed_ms),
+                     (uint32_t)((uint64_t)ctx.tx_bytes * 1000 / elapsed_ms),
+                     fill / 100,
+                     fill % 100);
+        return;
+    }
+
+    int count = ctx.cmds < MAX_SAMPLES ? ctx.cmds : MAX_SAMPLES;
+    memcpy(ctx.sorted_us, ctx.samples_us, count * sizeof(ctx.sorted_us[0]));
+    qsort(ctx.sorted_us, count, sizeof(ctx.sorted_us[0]), compare_samples);
+    stats_printf(writer, "probe=spp%s cmds:%"PRIu32" timeouts:%"PRIu32" per_s:%"PRIu32".%"PRIu32,
+                 ctx.mode != PROBE_MODE_OFF ? "*" : "",
+                 ctx.cmds,
+                 ctx.timeouts,
+                 ctx.cmds * 1000 / elapsed_ms,
+                 ctx.cmds * 10000 / elapsed_ms % 10);
+    if (count > 0)
+    {
+        stats_printf(writer, " p50:%"PRIu32"us p90:%"PRIu32"us p99:%"PRIu32"us max:%"PRIu32"us",
+                     percentile(count, 50),
+                     percentile(count, 90),
+                     percentile(count, 99),
+                     ctx.sorted_us[count - 1]);
+    }
+    stats_printf(writer, "\n");
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
+
+typedef enum
+{
+    PROBE_MODE_OFF,
+    // Client writes notified straight back
+    PROBE_MODE_ECHO,
+    // Client writes counted and dropped
+    PROBE_MODE_SINK,
+    // Notifications sent as fast as the link takes them
+    PROBE_MODE_FLOOD,
+    // Scripted commands to the adapter, one per prompt
+    PROBE_MODE_SPP,
+} probe_mode_t;
+
+bool probe_start_gatt(probe_mode_t mode);
+bool probe_start_spp(const char *cmds, uint16_t length);
+// GATT modes end at once, the SPP mode after the command in flight
+void probe_stop(void);
+void probe_end(void);
+probe_mode_t probe_get_mode(void);
+void probe_on_gatt_rx(const uint8_t *data, uint16_t length);
+// One burst of the flood probe, called under the bridge lock
+void probe_flood(void);
+// Returns NULL when the SPP probe is over
+const char *probe_next_cmd(void);
+void probe_on_cmd_done(bool completed);
+void probe_write_stats(stats_writer_t *writer);
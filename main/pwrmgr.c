@@ -0,0 +1,167 @@
+#include "pwrmgr.h"
+#include "app.h"
+
+#include <stdio.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+
+#define TAG "PWRMGR"
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+} latency_t;
+
+static struct
+{
+    esp_pm_lock_handle_t cmd_lock;
+    esp_timer_handle_t stats_timer;
+    int64_t cmd_start_time;
+    // Time the command lock kept the CPU at full frequency
+    uint64_t max_freq_us;
+
+    // GATT write event to SPP write, only for data forwarded as it arrives
+    latency_t forward;
+    // SPP write to the adapter's prompt
+    latency_t round_trip;
+} ctx;
+
+static void record_latency(latency_t *latency, int64_t us)
+{
+    latency->count++;
+    latency->total_us += us;
+    if (us > latency->max_us)
+    {
+        latency->max_us = us;
+    }
+}
+
+static uint32_t average_us(const latency_t *latency)
+{
+    return latency->count > 0 ? latency->total_us / latency->count : 0;
+}
+
+static void on_stats_timeout(void *arg)
+{
+    pwrmgr_log_stats();
+}
+
+void pwrmgr_init(void)
+{
+    esp_err_t err;
+
+#if CONFIG_VLINK_POWER_SAVE
+    const esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_VLINK_PM_MIN_FREQ_MHZ,
+        // The controller's main crystal sleep clock keeps light sleep
+        // locked out, modem sleep still applies
+        .light_sleep_enable = false,
+    };
+    err = esp_pm_configure(&pm_config);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_pm_configure failed: %d", err);
+        panic(PANIC_ID_PWRMGR_PM_CONFIGURE_FAILED);
+    }
+
+    err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "bridge_cmd", &ctx.cmd_lock);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_pm_lock_create failed: %d", err);
+        panic(PANIC_ID_PWRMGR_LOCK_CREATE_FAILED);
+    }
+#endif
+
+    if (CONFIG_VLINK_PM_STATS_INTERVAL_S > 0)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = on_stats_timeout,
+            .name = "pwr_stats",
+            .skip_unhandled_events = true,
+        };
+        err = esp_timer_create(&timer_args, &ctx.stats_timer);
+        if (err)
+        {
+            ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+            panic(PANIC_ID_PWRMGR_TIMER_CREATE_FAILED);
+        }
+        esp_timer_start_periodic(ctx.stats_timer,
+                                 CONFIG_VLINK_PM_STATS_INTERVAL_S * 1000000ULL);
+    }
+}
+
+void pwrmgr_on_cmd_start(int64_t rx_time)
+{
+#if CONFIG_VLINK_POWER_SAVE
+    esp_pm_lock_acquire(ctx.cmd_lock);
+#endif
+    ctx.cmd_start_time = esp_timer_get_time();
+    if (rx_time > 0)
+    {
+        record_latency(&ctx.forward, ctx.cmd_start_time - rx_time);
+    }
+}
+
+void pwrmgr_on_cmd_end(bool completed)
+{
+    int64_t us = esp_timer_get_time() - ctx.cmd_start_time;
+    ctx.max_freq_us += us;
+    if (completed)
+    {
+        record_latency(&ctx.round_trip, us);
+    }
+#if CONFIG_VLINK_POWER_SAVE
+    esp_pm_lock_release(ctx.cmd_lock);
+#endif
+}
+
+void pwrmgr_log_stats(void)
+{
+    ESP_LOGI(TAG, "Wake to forward: count=%"PRIu32" avg=%"PRIu32"us max=%"PRIu32"us",
+             ctx.forward.count,
+             average_us(&ctx.forward),
+             ctx.forward.max_us);
+    ESP_LOGI(TAG, "Command round trip: count=%"PRIu32" avg=%"PRIu32"us max=%"PRIu32"us",
+             ctx.round_trip.count,
+             average_us(&ctx.round_trip),
+             ctx.round_trip.max_us);
+#if CONFIG_PM_PROFILING
+    // Time spent in each power mode, as seen by the PM implementation
+    esp_pm_dump_locks(stdout);
+#endif
+}
+
+void pwrmgr_write_stats(stats_writer_t *writer)
+{
+    // count/avg/max
+    stats_printf(writer, "forward_us=%"PRIu32"/%"PRIu32"/%"PRIu32"\n",
+                 ctx.forward.count,
+                 average_us(&ctx.forward),
+                 ctx.forward.max_us);
+    stats_printf(writer, "rtt_us=%"PRIu32"/%"PRIu32"/%"PRIu32"\n",
+                 ctx.round_trip.count,
+                 average_us(&ctx.round_trip),
+                 ctx.round_trip.max_us);
+
+    // Residency since boot: held at full frequency by commands, and idle
+    // per core, where frequency scaling and modem sleep take over
+    int64_t uptime_us = esp_timer_get_time();
+    stats_printf(writer, "pm=max:%"PRIu32"%%", (uint32_t)(ctx.max_freq_us * 100 / uptime_us));
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_RUN_TIME_STATS_USING_ESP_TIMER
+    for (BaseType_t core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        uint64_t idle_us = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+        stats_printf(writer, "%s%"PRIu32"%%",
+                     core == 0 ? " idle:" : "/",
+                     (uint32_t)(idle_us * 100 / uptime_us));
+    }
+#endif
+    stats_printf(writer, "\n");
+}
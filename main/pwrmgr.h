@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "stats.h"
+
+void pwrmgr_init(void);
+// rx_time is 0 for data that was held, its latency is not recorded
+void pwrmgr_on_cmd_start(int64_t rx_time);
+void pwrmgr_on_cmd_end(bool completed);
+void pwrmgr_log_stats(void);
+void pwrmgr_write_stats(stats_writer_t *writer);
@@ -0,0 +1,400 @@
+#include "respcount.h"
+#include "elmcfg.h"
+#include "nvsstore.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <esp_log.h>
+
+#define TAG           "RESPCOUNT"
+#define NVS_NAMESPACE "respcount"
+
+#define MAX_ENTRIES        32
+// Mode plus up to three PID/DID bytes
+#define MAX_REQUEST_LEN    8
+// Identical answers needed before the count is appended
+#define STABLE_SAMPLES     4
+// Every so often a request goes out without the count to find new ECUs
+#define REVALIDATE_USES    32
+#define MAX_COUNT          0xF
+#define LINE_PREFIX_LEN    12
+
+typedef struct
+{
+    char request[MAX_REQUEST_LEN + 1];
+    uint8_t count;
+    uint8_t stable;
+    uint8_t uses;
+    // Answered by ISO-TP messages, the adapter counts frames then
+    bool multi_frame;
+} entry_t;
+
+typedef struct
+{
+    uint8_t count;
+    entry_t entries[MAX_ENTRIES];
+} saved_entries_t;
+
+static struct
+{
+    bool active;
+    bool dirty;
+    // Lines carry headers, responses cannot be told apart from frames
+    bool headers;
+    uint8_t adapter_addr[6];
+    // Count digit for the next request, 0 for none
+    uint8_t next_suffix;
+
+    // Request in flight, NULL when not learned from
+    entry_t *request;
+    char request_norm[MAX_REQUEST_LEN + 2];
+    uint8_t suffix;
+    uint8_t responses;
+    bool no_data;
+    bool multi_frame;
+    bool skip;
+
+    // Adapter output line being classified, spaces removed
+    char line[LINE_PREFIX_LEN];
+    uint16_t line_len;
+    bool line_hex;
+    bool line_colon;
+
+    uint32_t applied;
+    uint32_t misses;
+    saved_entries_t saved;
+} ctx;
+
+static void load_entries(void)
+{
+    char key[NVSSTORE_ADDR_KEY_LEN];
+    nvsstore_make_addr_key(ctx.adapter_addr, key);
+    if (!nvsstore_load_blob(NVS_NAMESPACE, key, &ctx.saved, sizeof(ctx.saved)) || ctx.saved.count > MAX_ENTRIES)
+    {
+        ctx.saved.count = 0;
+        return;
+    }
+    ESP_LOGI(TAG, "Loaded %d response counts for %s", ctx.saved.count, key);
+}
+
+static void save_entries(void)
+{
+    char key[NVSSTORE_ADDR_KEY_LEN];
+    nvsstore_make_addr_key(ctx.adapter_addr, key);
+    nvsstore_save_blob(NVS_NAMESPACE, key, &ctx.saved, sizeof(ctx.saved));
+}
+
+static bool is_hex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F');
+}
+
+// Returns the normalized length of an OBD request, 0 for anything else.
+// AT commands that change the reply format are handled here as well.
+static int parse_request(const char *line, uint16_t length, char *norm, int size)
+{
+    int norm_len = elmcfg_normalize(line, length, norm, size);
+    if (norm_len < 2)
+    {
+        return 0;
+    }
+
+    if (norm[0] == 'A' && norm[1] == 'T')
+    {
+        if (strcmp(norm + 2, "H1") == 0)
+        {
+            ctx.headers = true;
+        }
+        else if (strcmp(norm + 2, "H0") == 0 || strcmp(norm + 2, "Z") == 0 || strcmp(norm + 2, "D") == 0)
+        {
+            ctx.headers = false;
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < norm_len; i++)
+    {
+        if (!is_hex(norm[i]))
+        {
+            return 0;
+        }
+    }
+    return norm_len;
+}
+
+static entry_t *find_entry(const char *request, bool create)
+{
+    for (int i = 0; i < ctx.saved.count; i++)
+    {
+        if (strcmp(ctx.saved.entries[i].request, request) == 0)
+        {
+            return &ctx.saved.entries[i];
+        }
+    }
+
+    if (!create || ctx.saved.count == MAX_ENTRIES)
+    {
+        return NULL;
+    }
+
+    entry_t *entry = &ctx.saved.entries[ctx.saved.count++];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->request, request);
+    return entry;
+}
+
+static void finish_request(void)
+{
+    entry_t *entry = ctx.request;
+    ctx.request = NULL;
+
+    if (ctx.skip)
+    {
+        return;
+    }
+    if (ctx.multi_frame)
+    {
+        if (!entry->multi_frame)
+        {
+            entry->multi_frame = true;
+            ctx.dirty = true;
+        }
+        return;
+    }
+    if (ctx.no_data || ctx.responses == 0)
+    {
+        if (ctx.suffix)
+        {
+            entry->stable = 0;
+            ctx.misses++;
+            ctx.dirty = true;
+        }
+        return;
+    }
+
+    if (ctx.suffix)
+    {
+        // Fewer answers than asked for, the adapter waited out its timeout
+        if (ctx.responses < ctx.suffix)
+        {
+            ESP_LOGW(TAG, "%s answered %d of %d", entry->request, ctx.responses, ctx.suffix);
+            entry->stable = 0;
+            ctx.misses++;
+            ctx.dirty = true;
+        }
+        return;
+    }
+
+    // The largest count seen is kept, a slow ECU must not be cut off
+    if (ctx.responses > entry->count)
+    {
+        entry->count = ctx.responses > MAX_COUNT ? MAX_COUNT + 1 : ctx.responses;
+        entry->stable = 1;
+    }
+    else if (ctx.responses == entry->count)
+    {
+        if (entry->stable < STABLE_SAMPLES)
+        {
+            entry->stable++;
+        }
+    }
+    else
+    {
+        entry->stable = 0;
+    }
+    ctx.dirty = true;
+}
+
+void respcount_start(const uint8_t *adapter_addr)
+{
+    // A client resuming a lingering session keeps the learned state
+    if (ctx.active && memcmp(ctx.adapter_addr, adapter_addr, sizeof(ctx.adapter_addr)) == 0)
+    {
+        return;
+    }
+
+    respcount_stop();
+    memcpy(ctx.adapter_addr, adapter_addr, sizeof(ctx.adapter_addr));
+    load_entries();
+    ctx.active = true;
+    ctx.headers = false;
+}
+
+void respcount_stop(void)
+{
+    if (ctx.active && ctx.dirty)
+    {
+        save_entries();
+    }
+    ctx.active = false;
+    ctx.dirty = false;
+    ctx.request = NULL;
+    ctx.next_suffix = 0;
+}
+
+char respcount_suffix(const char *line, uint16_t length)
+{
+    char norm[MAX_REQUEST_LEN + 1];
+    ctx.next_suffix = 0;
+    if (!ctx.active || ctx.headers)
+    {
+        return 0;
+    }
+
+    // An odd length already carries the client's own count
+    int norm_len = elmcfg_normalize(line, length, norm, sizeof(norm));
+    if (norm_len < 2 || norm_len % 2 != 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < norm_len; i++)
+    {
+        if (!is_hex(norm[i]))
+        {
+            return 0;
+        }
+    }
+
+    entry_t *entry = find_entry(norm, false);
+    if (entry == NULL || entry->multi_frame || entry->stable < STABLE_SAMPLES || entry->count > MAX_COUNT)
+    {
+        return 0;
+    }
+    if (++entry->uses % REVALIDATE_USES == 0)
+    {
+        return 0;
+    }
+
+    ctx.next_suffix = entry->count;
+    ctx.applied++;
+    return "0123456789ABCDEF"[entry->count];
+}
+
+void respcount_on_request(const char *line, uint16_t length)
+{
+    ctx.request = NULL;
+    ctx.suffix = ctx.next_suffix;
+    ctx.next_suffix = 0;
+    if (!ctx.active)
+    {
+        return;
+    }
+
+    int norm_len = parse_request(line, length, ctx.request_norm, sizeof(ctx.request_norm));
+    if (norm_len == 0 || ctx.headers)
+    {
+        return;
+    }
+
+    // Learned from the request as the client wrote it
+    int request_len = ctx.suffix ? norm_len - 1 : norm_len;
+    if (request_len % 2 != 0)
+    {
+        return;
+    }
+    char request[MAX_REQUEST_LEN + 1];
+    memcpy(request, ctx.request_norm, request_len);
+    request[request_len] = '\0';
+
+    ctx.request = find_entry(request, true);
+    ctx.responses = 0;
+    ctx.no_data = false;
+    ctx.multi_frame = false;
+    ctx.skip = false;
+    ctx.line_len = 0;
+    ctx.line_hex = true;
+    ctx.line_colon = false;
+}
+
+static void classify_line(void)
+{
+    if (ctx.line_len == 0)
+    {
+        return;
+    }
+
+    if (ctx.line_len < sizeof(ctx.request_norm) && ctx.request_norm[ctx.line_len] == '\0'
+        && memcmp(ctx.line, ctx.request_norm, ctx.line_len) == 0)
+    {
+        // Echo of the request
+        return;
+    }
+    if (ctx.line_colon || (ctx.line_hex && ctx.line_len == 3))
+    {
+        // "0: 49 02 01..." frames and the message length before them
+        ctx.multi_frame = true;
+    }
+    else if (ctx.line_hex)
+    {
+        ctx.responses++;
+    }
+    else if (ctx.line_len == 6 && strncmp(ctx.line, "NODATA", 6) == 0)
+    {
+        ctx.no_data = true;
+    }
+    else
+    {
+        // Protocol search, bus errors and the like
+        ctx.skip = true;
+    }
+}
+
+void respcount_on_rx(const uint8_t *data, uint16_t length)
+{
+    if (ctx.request == NULL)
+    {
+        return;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        switch (c)
+        {
+        case ' ':
+            break;
+        case '\r':
+        case '\n':
+            classify_line();
+            ctx.line_len = 0;
+            ctx.line_hex = true;
+            ctx.line_colon = false;
+            break;
+        case '>':
+            classify_line();
+            finish_request();
+            return;
+        default:
+            if (ctx.line_len < sizeof(ctx.line))
+            {
+                ctx.line[ctx.line_len] = c;
+            }
+            ctx.line_len++;
+            ctx.line_hex = ctx.line_hex && is_hex(c);
+            ctx.line_colon = ctx.line_colon || c == ':';
+            break;
+        }
+    }
+}
+
+void respcount_write_stats(stats_writer_t *writer)
+{
+    int learned = 0;
+    for (int i = 0; i < ctx.saved.count; i++)
+    {
+        const entry_t *entry = &ctx.saved.entries[i];
+        if (!entry->multi_frame && entry->stable >= STABLE_SAMPLES && entry->count <= MAX_COUNT)
+        {
+            learned++;
+        }
+    }
+    stats_printf(writer, "respcount=%d/%d applied:%"PRIu32" miss:%"PRIu32"%s\n",
+                 learned,
+                 ctx.saved.count,
+                 ctx.applied,
+                 ctx.misses,
+                 ctx.headers ? " headers" : "");
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+#include "stats.h"
+
+void respcount_start(const uint8_t *adapter_addr);
+void respcount_stop(void);
+char respcount_suffix(const char *line, uint16_t length);
+void respcount_on_request(const char *line, uint16_t length);
+void respcount_on_rx(const uint8_t *data, uint16_t length);
+void respcount_write_stats(stats_writer_t *writer);
@@ -1,10 +1,19 @@
 #include "sppcomm.h"
 #include "app.h"
+#include "bootprof.h"
+#include "coex.h"
+#include "nvsstore.h"
 
+#include <string.h>
+#include <inttypes.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <esp_bt.h>
 #include <esp_gap_bt_api.h>
 #include <esp_spp_api.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define TAG "SPPCOMM"
 
@@ -12,16 +21,175 @@
 #define SEARCH_NAME                "V-LINK"
 static esp_bt_pin_code_t PINCODE = "1234";
 
+#define NVS_NAMESPACE     "sppcomm"
+#define NVS_KEY_HISTORY   "history"
+#define MAX_CANDIDATES    8
+#define MAX_HISTORY       8
+#define RSSI_UNKNOWN      -127
+// One point of link history weighs like this many dB of signal
+#define QUALITY_WEIGHT_DB 4
+#define QUALITY_MAX       5
+#define QUALITY_GOOD      1
+#define QUALITY_DROPPED   -1
+#define QUALITY_FAILED    -2
+
+typedef struct
+{
+    uint8_t bda[6];
+    int8_t rssi;
+    int8_t quality;
+} candidate_t;
+
+typedef struct
+{
+    uint8_t bda[6];
+    int8_t quality;
+} link_history_t;
+
+typedef struct
+{
+    uint8_t count;
+    link_history_t entries[MAX_HISTORY];
+} saved_history_t;
+
 static struct
 {
     uint8_t peer_bd_addr[6];
     uint32_t conn_handle;
+    uint8_t peer_scn;
+
+    // Last adapter connected to, reconnects skip inquiry and SDP
+    uint8_t last_bd_addr[6];
+    uint8_t last_scn;
+
+    // Adapters found by the current inquiry, tried best first
+    candidate_t candidates[MAX_CANDIDATES];
+    int candidate_count;
+    int candidates_found;
+    int candidates_tried;
+    // Inquiry results are still being gathered
+    bool collecting;
+    esp_timer_handle_t window_timer;
+    int8_t picked_rssi;
+    // An SPP session is open with last_bd_addr
+    bool session_open;
+    // How previous sessions with each adapter went, newest first
+    saved_history_t history;
+    bool history_loaded;
+
+    // Taken around the idle state, commands, the idle timer and GAP
+    // events run in different tasks
+    SemaphoreHandle_t idle_lock;
+    StaticSemaphore_t idle_lock_buffer;
+    esp_timer_handle_t idle_timer;
+    // A command was sent and the adapter has not shown its prompt
+    bool awaiting_prompt;
+    // The poll interval was raised after an idle period
+    bool relaxed;
+    bool sniff;
+    // When the first command after an idle period was queued, 0 if none
+    int64_t wake_start;
+    uint32_t relaxations;
+    uint32_t sniffs;
+    uint32_t wakes;
+    int64_t wake_total_us;
+    uint32_t wake_max_us;
 } ctx;
 
 #define CONN_HANDLE_INVALID 0xFFFFFFFF
 
+// The inquiry window ends in the timer task
+static portMUX_TYPE candidates_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void load_history(void)
+{
+    ctx.history_loaded = true;
+    if (!nvsstore_load_blob(NVS_NAMESPACE, NVS_KEY_HISTORY, &ctx.history, sizeof(ctx.history))
+        || ctx.history.count > MAX_HISTORY)
+    {
+        ctx.history.count = 0;
+    }
+}
+
+static void save_history(void)
+{
+    nvsstore_save_blob(NVS_NAMESPACE, NVS_KEY_HISTORY, &ctx.history, sizeof(ctx.history));
+}
+
+static int8_t get_quality(const uint8_t *bda)
+{
+    for (int i = 0; i < ctx.history.count; i++)
+    {
+        if (memcmp(ctx.history.entries[i].bda, bda, sizeof(ctx.history.entries[i].bda)) == 0)
+        {
+            return ctx.history.entries[i].quality;
+        }
+    }
+    return 0;
+}
+
+static void record_quality(const uint8_t *bda, int delta)
+{
+    if (!ctx.history_loaded)
+    {
+        load_history();
+    }
+
+    // Moved to the front, the oldest adapter falls off the end
+    link_history_t entry = { .quality = 0 };
+    memcpy(entry.bda, bda, sizeof(entry.bda));
+    int i = 0;
+    while (i < ctx.history.count
+           && memcmp(ctx.history.entries[i].bda, bda, sizeof(entry.bda)) != 0)
+    {
+        i++;
+    }
+    if (i < ctx.history.count)
+    {
+        entry.quality = ctx.history.entries[i].quality;
+    }
+    else if (ctx.history.count < MAX_HISTORY)
+    {
+        ctx.history.count++;
+    }
+    else
+    {
+        i = MAX_HISTORY - 1;
+    }
+    memmove(&ctx.history.entries[1], &ctx.history.entries[0], i * sizeof(entry));
+
+    int quality = entry.quality + delta;
+    if (quality > QUALITY_MAX)
+    {
+        quality = QUALITY_MAX;
+    }
+    if (quality < -QUALITY_MAX)
+    {
+        quality = -QUALITY_MAX;
+    }
+    entry.quality = quality;
+    ctx.history.entries[0] = entry;
+    save_history();
+}
+
+static int score(const candidate_t *candidate)
+{
+    return candidate->rssi + candidate->quality * QUALITY_WEIGHT_DB;
+}
+
 static void start_scan(void)
 {
+    if (!ctx.history_loaded)
+    {
+        load_history();
+    }
+    taskENTER_CRITICAL(&candidates_mux);
+    ctx.candidate_count = 0;
+    ctx.candidates_found = 0;
+    ctx.candidates_tried = 0;
+    ctx.collecting = true;
+    taskEXIT_CRITICAL(&candidates_mux);
+
     esp_err_t err = esp_bt_gap_start_discovery(ESP_BT_INQ_MODE_GENERAL_INQUIRY,
                                                INQUIRY_TIMEOUT_SECS * 100 / 128,
                                                0);
@@ -63,16 +231,247 @@ static bool is_eir_match(uint8_t *eir, int eir_len)
         && memcmp((const char *)name, SEARCH_NAME, len) == 0;
 }
 
+static void idle_lock_take(void)
+{
+    xSemaphoreTake(ctx.idle_lock, portMAX_DELAY);
+}
+
+static void idle_lock_give(void)
+{
+    xSemaphoreGive(ctx.idle_lock);
+}
+
+static void set_poll_interval(uint32_t t_poll)
+{
+    esp_err_t err = esp_bt_gap_set_qos(ctx.peer_bd_addr, t_poll);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_bt_gap_set_qos failed: %d", err);
+    }
+}
+
+static void restart_idle_timer(void)
+{
+    esp_timer_stop(ctx.idle_timer);
+    if (CONFIG_VLINK_SPP_IDLE_MS > 0 && !ctx.awaiting_prompt && ctx.conn_handle != CONN_HANDLE_INVALID)
+    {
+        esp_timer_start_once(ctx.idle_timer, CONFIG_VLINK_SPP_IDLE_MS * 1000);
+    }
+}
+
+static void on_idle_timeout(void *arg)
+{
+    idle_lock_take();
+    if (!ctx.awaiting_prompt && !ctx.relaxed && ctx.conn_handle != CONN_HANDLE_INVALID)
+    {
+        ESP_LOGI(TAG, "Link idle, poll interval %d slots", CONFIG_VLINK_SPP_IDLE_TPOLL);
+        ctx.relaxed = true;
+        ctx.relaxations++;
+        set_poll_interval(CONFIG_VLINK_SPP_IDLE_TPOLL);
+    }
+    idle_lock_give();
+}
+
+// Time from the first command after an idle period to the link being
+// back at full speed
+static void finish_wake(void)
+{
+    if (ctx.wake_start == 0)
+    {
+        return;
+    }
+    uint32_t elapsed_us = esp_timer_get_time() - ctx.wake_start;
+    ctx.wake_start = 0;
+    ctx.wakes++;
+    ctx.wake_total_us += elapsed_us;
+    if (elapsed_us > ctx.wake_max_us)
+    {
+        ctx.wake_max_us = elapsed_us;
+    }
+    ESP_LOGD(TAG, "Link awake after %"PRIu32" us", elapsed_us);
+}
+
+static void on_command(const uint8_t *data, uint16_t length)
+{
+    idle_lock_take();
+    if ((ctx.relaxed || ctx.sniff) && ctx.wake_start == 0)
+    {
+        ctx.wake_start = esp_timer_get_time();
+    }
+    if (ctx.relaxed)
+    {
+        ctx.relaxed = false;
+        set_poll_interval(coex_get_spp_tpoll());
+    }
+    ctx.awaiting_prompt = ctx.awaiting_prompt || memchr(data, '\r', length) != NULL;
+    restart_idle_timer();
+    idle_lock_give();
+}
+
+static void on_adapter_output(const uint8_t *data, uint16_t length)
+{
+    idle_lock_take();
+    if (memchr(data, '>', length) != NULL)
+    {
+        ctx.awaiting_prompt = false;
+    }
+    restart_idle_timer();
+    idle_lock_give();
+}
+
+static void reset_idle_state(void)
+{
+    idle_lock_take();
+    esp_timer_stop(ctx.idle_timer);
+    ctx.awaiting_prompt = false;
+    ctx.relaxed = false;
+    ctx.sniff = false;
+    ctx.wake_start = 0;
+    idle_lock_give();
+}
+
 static bool is_device_found(void)
 {
     return memcmp(ctx.peer_bd_addr, "\0\0\0\0\0\0", sizeof(ctx.peer_bd_addr)) != 0;
 }
 
+// Returns false once no candidate is left or the attempts are used up
+static bool connect_next_candidate(void)
+{
+    taskENTER_CRITICAL(&candidates_mux);
+    int best = -1;
+    if (ctx.candidates_tried < CONFIG_VLINK_SPP_CANDIDATE_ATTEMPTS)
+    {
+        for (int i = 0; i < ctx.candidate_count; i++)
+        {
+            if (best < 0 || score(&ctx.candidates[i]) > score(&ctx.candidates[best]))
+            {
+                best = i;
+            }
+        }
+    }
+    if (best >= 0)
+    {
+        memcpy(ctx.peer_bd_addr, ctx.candidates[best].bda, sizeof(ctx.peer_bd_addr));
+        ctx.picked_rssi = ctx.candidates[best].rssi;
+        ctx.candidates[best] = ctx.candidates[--ctx.candidate_count];
+        ctx.candidates_tried++;
+    }
+    taskEXIT_CRITICAL(&candidates_mux);
+    if (best < 0)
+    {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Connecting to %02x:%02x:%02x:%02x:%02x:%02x rssi=%d",
+             ctx.peer_bd_addr[0],
+             ctx.peer_bd_addr[1],
+             ctx.peer_bd_addr[2],
+             ctx.peer_bd_addr[3],
+             ctx.peer_bd_addr[4],
+             ctx.peer_bd_addr[5],
+             ctx.picked_rssi);
+    esp_err_t err = esp_spp_start_discovery(ctx.peer_bd_addr);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_spp_start_discovery failed: %d", err);
+        memset(ctx.peer_bd_addr, 0, sizeof(ctx.peer_bd_addr));
+        return false;
+    }
+    return true;
+}
+
+static void finish_collecting(void)
+{
+    taskENTER_CRITICAL(&candidates_mux);
+    bool collecting = ctx.collecting;
+    ctx.collecting = false;
+    taskEXIT_CRITICAL(&candidates_mux);
+    if (!collecting)
+    {
+        return;
+    }
+
+    esp_timer_stop(ctx.window_timer);
+    // SDP pages the adapter while the controller winds the inquiry down
+    esp_bt_gap_cancel_discovery();
+    if (ctx.candidates_found == 0)
+    {
+        ESP_LOGI(TAG, "Device not found");
+    }
+    if (!connect_next_candidate())
+    {
+        app_on_spp_connect_error();
+        sppcomm_disconnect();
+    }
+}
+
+static void on_window_timeout(void *arg)
+{
+    finish_collecting();
+}
+
+static void add_candidate(const uint8_t *bda, int8_t rssi)
+{
+    int8_t quality = get_quality(bda);
+    bool first = false;
+
+    taskENTER_CRITICAL(&candidates_mux);
+    if (!ctx.collecting)
+    {
+        taskEXIT_CRITICAL(&candidates_mux);
+        return;
+    }
+    int i = 0;
+    while (i < ctx.candidate_count && memcmp(ctx.candidates[i].bda, bda, sizeof(ctx.candidates[i].bda)) != 0)
+    {
+        i++;
+    }
+    if (i == ctx.candidate_count && i < MAX_CANDIDATES)
+    {
+        memcpy(ctx.candidates[i].bda, bda, sizeof(ctx.candidates[i].bda));
+        ctx.candidates[i].rssi = RSSI_UNKNOWN;
+        ctx.candidates[i].quality = quality;
+        ctx.candidate_count++;
+        ctx.candidates_found++;
+        first = ctx.candidates_found == 1;
+    }
+    if (i < ctx.candidate_count && rssi > ctx.candidates[i].rssi)
+    {
+        ctx.candidates[i].rssi = rssi;
+    }
+    taskEXIT_CRITICAL(&candidates_mux);
+
+    ESP_LOGI(TAG, "Candidate rssi=%d quality=%d", rssi, quality);
+    // Close enough and never troublesome, no need to look further
+    if (CONFIG_VLINK_SPP_CANDIDATE_WINDOW_MS == 0
+        || (rssi >= CONFIG_VLINK_SPP_STRONG_RSSI && quality >= 0))
+    {
+        finish_collecting();
+    }
+    else if (first)
+    {
+        esp_timer_start_once(ctx.window_timer, CONFIG_VLINK_SPP_CANDIDATE_WINDOW_MS * 1000);
+    }
+}
+
+static void on_connect_failed(void)
+{
+    if (is_device_found())
+    {
+        record_quality(ctx.peer_bd_addr, QUALITY_FAILED);
+        memset(ctx.peer_bd_addr, 0, sizeof(ctx.peer_bd_addr));
+    }
+    if (!connect_next_candidate())
+    {
+        app_on_spp_connect_error();
+        sppcomm_disconnect();
+    }
+}
+
 static void gap_event_handler(esp_bt_gap_cb_event_t event,
                               esp_bt_gap_cb_param_t *param)
 {
-    esp_err_t err;
-
     switch(event)
     {
     case ESP_BT_GAP_DISC_RES_EVT:
@@ -83,38 +482,69 @@ static void gap_event_handler(esp_bt_gap_cb_event_t event,
                  param->disc_res.bda[3],
                  param->disc_res.bda[4],
                  param->disc_res.bda[5]);
+        bool match = false;
+        int8_t rssi = RSSI_UNKNOWN;
         for (int i = 0; i < param->disc_res.num_prop; i++)
         {
-            if (param->disc_res.prop[i].type == ESP_BT_GAP_DEV_PROP_EIR
-                && is_eir_match(param->disc_res.prop[i].val, param->disc_res.prop[i].len))
+            const esp_bt_gap_dev_prop_t *prop = &param->disc_res.prop[i];
+            if (prop->type == ESP_BT_GAP_DEV_PROP_EIR)
             {
-                ESP_LOGI(TAG, "Found target device");
-                memcpy(ctx.peer_bd_addr, param->disc_res.bda, sizeof(ctx.peer_bd_addr));
-                esp_bt_gap_cancel_discovery();
-                err = esp_spp_start_discovery(ctx.peer_bd_addr);
-                if (err)
-                {
-                    ESP_LOGW(TAG, "esp_spp_start_discovery failed: %d", err);
-                    app_on_spp_connect_error();
-                    sppcomm_disconnect();
-                }
-                break;
+                match = match || is_eir_match(prop->val, prop->len);
             }
+            else if (prop->type == ESP_BT_GAP_DEV_PROP_RSSI)
+            {
+                rssi = *(int8_t *)prop->val;
+            }
+        }
+        if (match)
+        {
+            add_candidate(param->disc_res.bda, rssi);
         }
         break;
 
     case ESP_BT_GAP_DISC_STATE_CHANGED_EVT:
         ESP_LOGI(TAG, "ESP_BT_GAP_DISC_STATE_CHANGED_EVT: state=%d",
                  param->disc_st_chg.state);
-        if (param->disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STOPPED
-            && !is_device_found())
+        if (param->disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STOPPED)
         {
-            ESP_LOGI(TAG, "Device not found");
-            app_on_spp_connect_error();
-            sppcomm_disconnect();
+            finish_collecting();
         }
         break;
 
+    case ESP_BT_GAP_MODE_CHG_EVT:
+        // Sniff is negotiated by the stack's power manager or the adapter
+        ESP_LOGI(TAG, "ESP_BT_GAP_MODE_CHG_EVT: mode=%d", param->mode_chg.mode);
+        idle_lock_take();
+        if (param->mode_chg.mode == ESP_BT_PM_MD_SNIFF)
+        {
+            ctx.sniff = true;
+            ctx.sniffs++;
+        }
+        else if (param->mode_chg.mode == ESP_BT_PM_MD_ACTIVE)
+        {
+            ctx.sniff = false;
+            if (!ctx.relaxed)
+            {
+                finish_wake();
+            }
+        }
+        idle_lock_give();
+        break;
+
+    case ESP_BT_GAP_QOS_CMPL_EVT:
+        if (param->qos_cmpl.stat != ESP_BT_STATUS_SUCCESS)
+        {
+            ESP_LOGW(TAG, "ESP_BT_GAP_QOS_CMPL_EVT failed: %d", param->qos_cmpl.stat);
+        }
+        idle_lock_take();
+        // Completion of the relaxing request is not a wake-up
+        if (!ctx.relaxed && !ctx.sniff && param->qos_cmpl.t_poll < CONFIG_VLINK_SPP_IDLE_TPOLL)
+        {
+            finish_wake();
+        }
+        idle_lock_give();
+        break;
+
     default:
         break;
     }
@@ -148,6 +578,7 @@ static void spp_event_handler(esp_spp_cb_event_t event, esp_spp_cb_param_t *para
             ESP_LOGE(TAG, "esp_bt_gap_set_scan_mode failed: %d", err);
             panic(0);
         }
+        bootprof_mark(BOOT_PHASE_SPP_READY);
         break;
 
     case ESP_SPP_DISCOVERY_COMP_EVT:
@@ -156,20 +587,19 @@ static void spp_event_handler(esp_spp_cb_event_t event, esp_spp_cb_param_t *para
         {
             ESP_LOGW(TAG, "ESP_SPP_DISCOVERY_COMP_EVT failed: %d",
                      param->disc_comp.status);
-            app_on_spp_connect_error();
-            sppcomm_disconnect();
+            on_connect_failed();
             break;
         }
 
+        ctx.peer_scn = param->disc_comp.scn[0];
         err = esp_spp_connect(ESP_SPP_SEC_NONE,
                               ESP_SPP_ROLE_MASTER,
-                              param->disc_comp.scn[0],
+                              ctx.peer_scn,
                               ctx.peer_bd_addr);
         if (err)
         {
             ESP_LOGW(TAG, "esp_spp_connect failed: %d", err);
-            app_on_spp_connect_error();
-            sppcomm_disconnect();
+            on_connect_failed();
         }
         break;
 
@@ -178,19 +608,36 @@ static void spp_event_handler(esp_spp_cb_event_t event, esp_spp_cb_param_t *para
         if (param->open.status != ESP_SPP_SUCCESS)
         {
             ESP_LOGE(TAG, "ESP_SPP_OPEN_EVT: %d", param->open.status);
-            app_on_spp_connect_error();
-            sppcomm_disconnect();
+            on_connect_failed();
             break;
         }
 
         ctx.conn_handle = param->open.handle;
+        ctx.session_open = true;
+        memcpy(ctx.last_bd_addr, ctx.peer_bd_addr, sizeof(ctx.last_bd_addr));
+        ctx.last_scn = ctx.peer_scn;
+        idle_lock_take();
+        if (coex_get_spp_tpoll() != ESP_BT_GAP_TPOLL_DFT)
+        {
+            set_poll_interval(coex_get_spp_tpoll());
+        }
+        restart_idle_timer();
+        idle_lock_give();
         app_on_spp_connected();
         break;
 
     case ESP_SPP_CLOSE_EVT:
         ESP_LOGI(TAG, "~~~~~~~~~~ ESP_SPP_CLOSE_EVT ~~~~~~~~~~");
+        if (ctx.session_open)
+        {
+            // Still open on our side, the adapter or the radio dropped it
+            record_quality(ctx.last_bd_addr,
+                           ctx.conn_handle != CONN_HANDLE_INVALID ? QUALITY_DROPPED : QUALITY_GOOD);
+            ctx.session_open = false;
+        }
         ctx.conn_handle = CONN_HANDLE_INVALID;
         memset(ctx.peer_bd_addr, 0, sizeof(ctx.peer_bd_addr));
+        reset_idle_state();
         app_on_spp_disconnected();
         break;
 
@@ -205,6 +652,7 @@ static void spp_event_handler(esp_spp_cb_event_t event, esp_spp_cb_param_t *para
 
     case ESP_SPP_DATA_IND_EVT:
         ESP_LOGD(TAG, "ESP_SPP_DATA_IND_EVT");
+        on_adapter_output(param->data_ind.data, param->data_ind.len);
         app_on_spp_rx(param->data_ind.data, param->data_ind.len);
         break;
 
@@ -219,6 +667,35 @@ void sppcomm_init(void)
 
     ctx.conn_handle = CONN_HANDLE_INVALID;
 
+    ctx.idle_lock = xSemaphoreCreateMutexStatic(&ctx.idle_lock_buffer);
+    if (ctx.idle_lock == NULL)
+    {
+        ESP_LOGE(TAG, "xSemaphoreCreateMutexStatic failed");
+        panic(0);
+    }
+
+    const esp_timer_create_args_t idle_timer_args = {
+        .callback = on_idle_timeout,
+        .name = "spp_idle",
+    };
+    err = esp_timer_create(&idle_timer_args, &ctx.idle_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(0);
+    }
+
+    const esp_timer_create_args_t window_timer_args = {
+        .callback = on_window_timeout,
+        .name = "spp_window",
+    };
+    err = esp_timer_create(&window_timer_args, &ctx.window_timer);
+    if (err)
+    {
+        ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+        panic(0);
+    }
+
     err = esp_bt_gap_register_callback(gap_event_handler);
     if (err)
     {
@@ -259,6 +736,32 @@ void sppcomm_connect(void)
     start_scan();
 }
 
+void sppcomm_reconnect(void)
+{
+    if (ctx.last_scn == 0)
+    {
+        start_scan();
+        return;
+    }
+
+    taskENTER_CRITICAL(&candidates_mux);
+    ctx.candidate_count = 0;
+    ctx.collecting = false;
+    taskEXIT_CRITICAL(&candidates_mux);
+    memcpy(ctx.peer_bd_addr, ctx.last_bd_addr, sizeof(ctx.peer_bd_addr));
+    ctx.peer_scn = ctx.last_scn;
+    esp_err_t err = esp_spp_connect(ESP_SPP_SEC_NONE,
+                                    ESP_SPP_ROLE_MASTER,
+                                    ctx.peer_scn,
+                                    ctx.peer_bd_addr);
+    if (err)
+    {
+        ESP_LOGW(TAG, "esp_spp_connect failed: %d", err);
+        memset(ctx.peer_bd_addr, 0, sizeof(ctx.peer_bd_addr));
+        app_on_spp_connect_error();
+    }
+}
+
 void sppcomm_disconnect(void)
 {
     if (ctx.conn_handle != CONN_HANDLE_INVALID)
@@ -266,11 +769,13 @@ void sppcomm_disconnect(void)
         esp_spp_disconnect(ctx.conn_handle);
         ctx.conn_handle = CONN_HANDLE_INVALID;
         memset(ctx.peer_bd_addr, 0, sizeof(ctx.peer_bd_addr));
+        reset_idle_state();
     }
 }
 
 void sppcomm_tx(const uint8_t *data, uint16_t length)
 {
+    on_command(data, length);
     esp_err_t err = esp_spp_write(ctx.conn_handle, length, (uint8_t *)data);
     if (err)
     {
@@ -278,3 +783,24 @@ void sppcomm_tx(const uint8_t *data, uint16_t length)
         panic(0);
     }
 }
+
+const uint8_t *sppcomm_get_peer_addr(void)
+{
+    return ctx.last_bd_addr;
+}
+
+void sppcomm_write_stats(stats_writer_t *writer)
+{
+    idle_lock_take();
+    stats_printf(writer, "spp_idle=relax:%"PRIu32" sniff:%"PRIu32" wake:%"PRIu32" avg:%"PRIu32"ms max:%"PRIu32"ms\n",
+                 ctx.relaxations,
+                 ctx.sniffs,
+                 ctx.wakes,
+                 ctx.wakes > 0 ? (uint32_t)(ctx.wake_total_us / ctx.wakes / 1000) : 0,
+                 ctx.wake_max_us / 1000);
+    idle_lock_give();
+    stats_printf(writer, "spp_pick=found:%d tried:%d rssi:%d\n",
+                 ctx.candidates_found,
+                 ctx.candidates_tried,
+                 ctx.picked_rssi);
+}
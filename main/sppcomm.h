@@ -1,7 +1,11 @@
 #pragma once
 #include <stdint.h>
+#include "stats.h"
 
 void sppcomm_init(void);
 void sppcomm_connect(void);
+void sppcomm_reconnect(void);
 void sppcomm_disconnect(void);
 void sppcomm_tx(const uint8_t *data, uint16_t length);
+const uint8_t *sppcomm_get_peer_addr(void);
+void sppcomm_write_stats(stats_writer_t *writer);
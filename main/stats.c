@@ -0,0 +1,260 @@
+#include "stats.h"
+#include "app.h"
+#include "bootprof.h"
+#include "bufpool.h"
+#include "coex.h"
+#include "datalog.h"
+#include "gattcomm.h"
+#include "isotp.h"
+#include "lzss.h"
+#include "elmtiming.h"
+#include "respcount.h"
+#include "elmfmt.h"
+#include "monitor.h"
+#include "probe.h"
+#include "ledmgr.h"
+#include "pwrmgr.h"
+#include "sppcomm.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#define TAG       "STATS"
+#define MAX_TASKS 24
+// Ends a page that did not fit
+#define TRUNCATED_MARKER "...\n"
+
+static struct
+{
+    // stats_format() is called from the BTC task and the log timer
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lock_buffer;
+    esp_timer_handle_t log_timer;
+    TaskStatus_t tasks[MAX_TASKS];
+    stats_page_t page;
+    char log_buffer[512];
+} ctx;
+
+void stats_printf(stats_writer_t *writer, const char *format, ...)
+{
+    if (writer->length + 1 >= writer->size)
+    {
+        writer->truncated = true;
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(writer->buffer + writer->length,
+                      writer->size - writer->length,
+                      format,
+                      args);
+    va_end(args);
+
+    if (n > 0)
+    {
+        writer->length += n;
+        // Truncated output still ends with the terminator
+        if (writer->length >= writer->size)
+        {
+            writer->length = writer->size - 1;
+            writer->truncated = true;
+        }
+    }
+}
+
+static UBaseType_t get_tasks(configRUN_TIME_COUNTER_TYPE *total_run_time)
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    return uxTaskGetSystemState(ctx.tasks, MAX_TASKS, total_run_time);
+#else
+    *total_run_time = 0;
+    return uxTaskGetSystemState(ctx.tasks, MAX_TASKS, NULL);
+#endif
+}
+
+static void write_memory_stats(stats_writer_t *writer)
+{
+    stats_printf(writer, "heap=%zu min=%zu largest=%zu\n",
+                 heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                 heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                 heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+    // Stack high-water marks are in bytes on this port
+    configRUN_TIME_COUNTER_TYPE total_run_time;
+    UBaseType_t count = get_tasks(&total_run_time);
+    stats_printf(writer, "stack_free=");
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        stats_printf(writer, "%s%s:%"PRIu32,
+                     i > 0 ? "," : "",
+                     ctx.tasks[i].pcTaskName,
+                     (uint32_t)ctx.tasks[i].usStackHighWaterMark);
+    }
+    stats_printf(writer, "\n");
+}
+
+static void write_cpu_stats(stats_writer_t *writer)
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total_run_time;
+    UBaseType_t count = get_tasks(&total_run_time);
+    // Percent of one core since boot and the core the task is pinned to,
+    // tasks below 1% are left out
+    stats_printf(writer, "cpu=");
+    bool first = true;
+    for (UBaseType_t i = 0; i < count && total_run_time > 0; i++)
+    {
+        uint32_t percent = (uint64_t)ctx.tasks[i].ulRunTimeCounter * 100 / total_run_time;
+        if (percent == 0)
+        {
+            continue;
+        }
+        BaseType_t core = xTaskGetCoreID(ctx.tasks[i].xHandle);
+        stats_printf(writer, "%s%s:%"PRIu32"@%c",
+                     first ? "" : ",",
+                     ctx.tasks[i].pcTaskName,
+                     percent,
+                     core == tskNO_AFFINITY ? '*' : '0' + (int)core);
+        first = false;
+    }
+    stats_printf(writer, "\n");
+#endif
+}
+
+static void write_page(stats_page_t page, stats_writer_t *writer)
+{
+    stats_printf(writer, "page=%d/%d\n", page, STATS_PAGE_COUNT);
+    switch (page)
+    {
+    case STATS_PAGE_LINK:
+        bootprof_write_stats(writer);
+        gattcomm_write_stats(writer);
+        pwrmgr_write_stats(writer);
+        app_write_stats(writer);
+        break;
+    case STATS_PAGE_ADAPTER:
+        sppcomm_write_stats(writer);
+        coex_write_stats(writer);
+        monitor_write_stats(writer);
+        break;
+    case STATS_PAGE_PROBE:
+        // The last run's results, however long the other pages get
+        probe_write_stats(writer);
+        break;
+    case STATS_PAGE_FEATURES:
+        stats_printf(writer, "led_wakeups=%"PRIu32"/min\n", ledmgr_get_wakeups_per_minute());
+        bufpool_write_stats(writer);
+#if CONFIG_VLINK_ISOTP_REASSEMBLY
+        isotp_write_stats(writer);
+#endif
+#if CONFIG_VLINK_ELM_ADAPTIVE_TIMEOUT
+        elmtiming_write_stats(writer);
+#endif
+#if CONFIG_VLINK_ELM_RESPONSE_COUNT
+        respcount_write_stats(writer);
+#endif
+#if CONFIG_VLINK_ELM_COMPACT_FORMAT
+        elmfmt_write_stats(writer);
+#endif
+#if CONFIG_VLINK_DATALOG
+        datalog_write_stats(writer);
+#endif
+#if CONFIG_VLINK_BLE_COMPRESSION
+        lzss_write_stats(writer);
+#endif
+        break;
+    case STATS_PAGE_MEMORY:
+        write_memory_stats(writer);
+        break;
+    case STATS_PAGE_CPU:
+        write_cpu_stats(writer);
+        break;
+    case STATS_PAGE_COUNT:
+        break;
+    }
+}
+
+static size_t format_page(stats_page_t page, char *buffer, size_t size)
+{
+    stats_writer_t writer = {
+        .buffer = buffer,
+        .size = size,
+    };
+    if (size > 0)
+    {
+        buffer[0] = '\0';
+    }
+
+    write_page(page, &writer);
+    if (writer.truncated && size > sizeof(TRUNCATED_MARKER))
+    {
+        // Readers see that lines are missing
+        writer.length = size - sizeof(TRUNCATED_MARKER);
+        memcpy(buffer + writer.length, TRUNCATED_MARKER, sizeof(TRUNCATED_MARKER));
+        writer.length += sizeof(TRUNCATED_MARKER) - 1;
+    }
+    return writer.length;
+}
+
+bool stats_select_page(int page)
+{
+    if (page < 0 || page >= STATS_PAGE_COUNT)
+    {
+        return false;
+    }
+    xSemaphoreTake(ctx.lock, portMAX_DELAY);
+    ctx.page = page;
+    xSemaphoreGive(ctx.lock);
+    return true;
+}
+
+size_t stats_format(char *buffer, size_t size)
+{
+    xSemaphoreTake(ctx.lock, portMAX_DELAY);
+    size_t length = format_page(ctx.page, buffer, size);
+    xSemaphoreGive(ctx.lock);
+    return length;
+}
+
+static void on_log_timeout(void *arg)
+{
+    xSemaphoreTake(ctx.lock, portMAX_DELAY);
+    for (stats_page_t page = 0; page < STATS_PAGE_COUNT; page++)
+    {
+        format_page(page, ctx.log_buffer, sizeof(ctx.log_buffer));
+        ESP_LOGI(TAG, "\n%s", ctx.log_buffer);
+    }
+    xSemaphoreGive(ctx.lock);
+}
+
+void stats_init(void)
+{
+    ctx.lock = xSemaphoreCreateMutexStatic(&ctx.lock_buffer);
+
+    if (CONFIG_VLINK_STATS_LOG_INTERVAL_S > 0)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = on_log_timeout,
+            .name = "stats_log",
+            .skip_unhandled_events = true,
+        };
+        esp_err_t err = esp_timer_create(&timer_args, &ctx.log_timer);
+        if (err)
+        {
+            ESP_LOGE(TAG, "esp_timer_create failed: %d", err);
+            panic(PANIC_ID_STATS_TIMER_CREATE_FAILED);
+        }
+        esp_timer_start_periodic(ctx.log_timer,
+                                 CONFIG_VLINK_STATS_LOG_INTERVAL_S * 1000000ULL);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+    bool truncated;
+} stats_writer_t;
+
+// Each page fits the 512 byte stats characteristic, the control
+// characteristic's "STATS <n>" selects the one that is read
+typedef enum
+{
+    STATS_PAGE_LINK,
+    STATS_PAGE_ADAPTER,
+    STATS_PAGE_PROBE,
+    STATS_PAGE_FEATURES,
+    STATS_PAGE_MEMORY,
+    STATS_PAGE_CPU,
+    STATS_PAGE_COUNT,
+} stats_page_t;
+
+void stats_printf(stats_writer_t *writer, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void stats_init(void);
+bool stats_select_page(int page);
+// Formats the selected page
+size_t stats_format(char *buffer, size_t size);